@@ -0,0 +1,179 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#include <curl/curl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "qlever-petrimaps/GeomCache.h"
+#include "qlever-petrimaps/MemoryBudget.h"
+#include "util/Misc.h"
+#include "util/log/Log.h"
+
+using petrimaps::GeomCache;
+using petrimaps::MemoryBudget;
+using util::LogLevel::ERROR;
+using util::LogLevel::INFO;
+using util::LogLevel::WARN;
+
+// _____________________________________________________________________________
+void printHelp(int argc, char** argv) {
+  UNUSED(argc);
+  std::cout << "Usage: " << argv[0]
+            << " -c <cachedir> [-m <maxmemory>] [-d <tsv> <ids> <indexhash>]"
+               " [-f] [-s] [-z] [--help] [-h] <backend>"
+            << "\n";
+  std::cout
+      << "\nBuilds the geometry cache file for <backend> in <cachedir>, as "
+         "qlever-petrimaps\nwould on the first request.\n"
+      << "\nAllowed arguments:\n    -c <dir>     cache dir"
+      << "\n    -m <memory>  Max memory in GB (default: 90% of system RAM)"
+      << "\n    -d <tsv> <ids> <indexhash>"
+      << "\n                 read the fill query results from local dumps "
+         "(TSV and\n                 application/octet-stream) instead of "
+         "the backend,\n                 <indexhash> is the raw response to "
+         "?cmd=get-index-id"
+      << "\n    -f           rebuild even if the cache file is up to date"
+      << "\n    -s           sort geometries along a Hilbert curve"
+      << "\n    -z           store line geometries compressed\n";
+}
+
+// _____________________________________________________________________________
+int main(int argc, char** argv) {
+  // disable output buffering for standard output
+  setbuf(stdout, NULL);
+
+  // init CURL
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  bool spatialSort = false;
+  bool compressLines = false;
+  bool force = false;
+  double maxMemoryGB =
+      (sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) * 0.9) / 1000000000;
+  std::string cacheDir, backend, dumpTsv, dumpIds, dumpIndexHash;
+
+  for (int i = 1; i < argc; i++) {
+    std::string cur = argv[i];
+    if (cur == "-h" || cur == "--help") {
+      printHelp(argc, argv);
+      exit(0);
+    } else if (cur == "-m") {
+      if (++i >= argc) {
+        LOG(ERROR) << "Missing argument for max memory (-m).";
+        exit(1);
+      }
+      maxMemoryGB = atof(argv[i]);
+    } else if (cur == "-c") {
+      if (++i >= argc) {
+        LOG(ERROR) << "Missing argument for cache dir (-c).";
+        exit(1);
+      }
+      cacheDir = argv[i];
+    } else if (cur == "-d") {
+      if (i + 3 >= argc) {
+        LOG(ERROR) << "Missing arguments for dump files (-d).";
+        exit(1);
+      }
+      dumpTsv = argv[++i];
+      dumpIds = argv[++i];
+      dumpIndexHash = argv[++i];
+    } else if (cur == "-f") {
+      force = true;
+    } else if (cur == "-s") {
+      spatialSort = true;
+    } else if (cur == "-z") {
+      compressLines = true;
+    } else {
+      backend = cur;
+    }
+  }
+
+  if (backend.empty() || cacheDir.empty()) {
+    printHelp(argc, argv);
+    exit(1);
+  }
+
+  std::string cacheFile = backend;
+  util::replaceAll(cacheFile, "/", "_");
+  cacheFile = cacheDir + "/" + cacheFile;
+
+  try {
+    if (force) unlink(cacheFile.c_str());
+
+    MemoryBudget budget(maxMemoryGB * 1000000000);
+    GeomCache cache(backend, &budget, spatialSort, compressLines, 0, false);
+    if (dumpTsv.size()) cache.setDump(dumpTsv, dumpIds, dumpIndexHash);
+
+    LOG(INFO) << "Building cache for " << backend << "...";
+    LOG(INFO) << "Max memory is " << maxMemoryGB << " GB...";
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<bool> done(false);
+
+    std::thread progress([&cache, &done, start]() {
+      static const char* stages[] = {"", "parsing geometries",
+                                     "parsing qlever IDs", "reading from file",
+                                     "finished"};
+      size_t lastRow = 0;
+      int lastStage = 0;
+      auto last = start;
+      while (!done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto now = std::chrono::steady_clock::now();
+        if (now - last < std::chrono::seconds(5)) continue;
+
+        int stage = cache.getLoadStatusStage();
+        size_t row = cache.getCurrentProgress();
+        if (stage != lastStage || row < lastRow) lastRow = 0;
+
+        double secs = std::chrono::duration<double>(now - last).count();
+        LOG(INFO) << "[PROGRESS] " << stages[stage] << ": " << row << " of "
+                  << cache.getTotalProgress() << " rows (" << std::fixed
+                  << std::setprecision(2) << cache.getLoadStatusPercent(true)
+                  << "% total, " << std::setprecision(0)
+                  << (row - lastRow) / secs << " rows/s)";
+
+        lastRow = row;
+        lastStage = stage;
+        last = now;
+      }
+    });
+
+    try {
+      cache.load(cacheDir);
+    } catch (...) {
+      done = true;
+      progress.join();
+      throw;
+    }
+
+    done = true;
+    progress.join();
+
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    struct stat st;
+    double mb = 0;
+    if (stat(cacheFile.c_str(), &st) == 0) mb = st.st_size / (1024.0 * 1024.0);
+
+    LOG(INFO) << "Cache file " << cacheFile << " is ready (" << std::fixed
+              << std::setprecision(2) << mb << " MB, index hash '"
+              << cache.getIndexHash() << "')";
+    LOG(INFO) << "Took " << secs << " s, " << std::setprecision(0)
+              << cache.getTotalProgress() / secs << " rows/s, "
+              << std::setprecision(2) << mb / secs << " MB/s";
+  } catch (const std::exception& e) {
+    LOG(ERROR) << e.what();
+    exit(1);
+  }
+}
@@ -3,18 +3,32 @@
 // Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
 
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <random>
 #include <sstream>
+#include <type_traits>
 
 #include "qlever-petrimaps/GeomCache.h"
 #include "qlever-petrimaps/Misc.h"
+#include "qlever-petrimaps/Sparql.h"
 #include "qlever-petrimaps/server/Requestor.h"
 #include "util/Misc.h"
 #include "util/geo/Geo.h"
@@ -37,7 +51,13 @@ using util::LogLevel::INFO;
 using util::LogLevel::WARN;
 
 // change on each index-breaking change to the code base
-const static std::string INDEX_HASH_PREFIX = "_3_";
+// caches built with a different geometry id width are incompatible
+const static std::string INDEX_HASH_PREFIX =
+    "_10_" + std::to_string(sizeof(ID_TYPE) * 8) + "_";
+
+// connect and total timeouts (in seconds) of index hash requests
+const static long INDEX_HASH_CONNECT_TIMEOUT = 10;
+const static long INDEX_HASH_TIMEOUT = 30;
 
 // Different SPAQRL queries to obtain the WKT geometries from an endpoint.
 // It depends on the endpoint which query is used, see `getQuery`.
@@ -114,6 +134,92 @@ size_t GeomCache::writeCbString(void *contents, size_t size, size_t nmemb,
   return size * nmemb;
 }
 
+namespace {
+
+// _____________________________________________________________________________
+std::string newBuildId() {
+  std::random_device rd;
+  uint64_t id = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^
+                std::chrono::system_clock::now().time_since_epoch().count();
+  std::stringstream ss;
+  ss << std::hex << std::setw(16) << std::setfill('0') << id;
+  return ss.str();
+}
+
+// the sections of cache files start at multiples of this, which is only a
+// page boundary on systems with 4 KiB pages, see pageAlign()
+const size_t SECTION_ALIGN = 4096;
+
+// _____________________________________________________________________________
+std::pair<char *, size_t> pageAlign(const char *p, size_t len) {
+  // madvise() and mincore() need page aligned addresses, extend the range
+  // down to the page p is in
+  size_t pageSize = sysconf(_SC_PAGE_SIZE);
+  size_t off = reinterpret_cast<uintptr_t>(p) % pageSize;
+  return {const_cast<char *>(p) - off, len + off};
+}
+
+// _____________________________________________________________________________
+void adviseRandom(const char *p, size_t len) {
+  if (len == 0) return;
+  auto range = pageAlign(p, len);
+  if (madvise(range.first, range.second, MADV_RANDOM) != 0) {
+    LOG(WARN) << "[GEOMCACHE] Could not advise random access to mapped "
+              << "section: " << strerror(errno);
+  }
+}
+
+// _____________________________________________________________________________
+void alignWrite(std::ostream *f) {
+  static const char zeros[SECTION_ALIGN] = {};
+  size_t pos = f->tellp();
+  f->write(zeros, (SECTION_ALIGN - pos % SECTION_ALIGN) % SECTION_ALIGN);
+}
+
+// _____________________________________________________________________________
+std::streampos alignRead(std::istream *f) {
+  size_t pos = f->tellg();
+  pos = (pos + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+  f->seekg(pos);
+  return pos;
+}
+
+// Exclusive advisory lock on a file, held until destruction. Works across
+// processes and across threads with their own FileLock.
+class FileLock {
+ public:
+  explicit FileLock(const std::string &fname)
+      : _fd(open(fname.c_str(), O_RDWR | O_CREAT, 0644)) {
+    if (_fd == -1) {
+      LOG(WARN) << "[GEOMCACHE] Could not open lock file " << fname;
+      return;
+    }
+
+    if (flock(_fd, LOCK_EX | LOCK_NB) == 0) return;
+
+    LOG(INFO) << "[GEOMCACHE] Waiting for lock " << fname
+              << " held by another build...";
+    int r;
+    do {
+      r = flock(_fd, LOCK_EX);
+    } while (r != 0 && errno == EINTR);
+  }
+
+  ~FileLock() {
+    if (_fd == -1) return;
+    flock(_fd, LOCK_UN);
+    close(_fd);
+  }
+
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+ private:
+  int _fd;
+};
+
+}  // namespace
+
 // _____________________________________________________________________________
 size_t GeomCache::writeCb(void *contents, size_t size, size_t nmemb,
                           void *userp) {
@@ -181,62 +287,78 @@ void GeomCache::parse(const char *c, size_t size) {
           // if the previous was not a multi geometry, and if the strings
           // match exactly, re-use the geometry
           if (_prev == _dangling && _lastQidToId.qid == 0) {
-            IdMapping idm{0, _lastQidToId.id};
-            _lastQidToId = idm;
-            _qidToIdF.write(reinterpret_cast<const char *>(&idm),
-                            sizeof(IdMapping));
-            _qidToIdFSize++;
+            reuseGeom(_lastQidToId.id);
+            _adjacentHits++;
           } else {
-            const char *s = 0;
-            auto wktType = util::geo::getWKTType(_dangling.c_str(), &s);
-            size_t i = 0;
-
-            if (wktType == util::geo::WKTType::COLLECTION) {
-              _curUniqueGeom++;
-              const auto &coll =
-                  util::geo::collectionFromWKTProj<double>(s, 0, &projD);
-
-              for (const auto &g : coll) {
-                if (g.getType() == 0) addMultiPoint({g.getPoint()}, &i);
-                if (g.getType() == 1) addLineString(g.getLine(), &i);
-                if (g.getType() == 2) addPolygon(g.getPolygon(), &i);
-                if (g.getType() == 3) addMultiLineString(g.getMultiLine(), &i);
-                if (g.getType() == 4) addMultiPolygon(g.getMultiPolygon(), &i);
-                if (g.getType() == 6) addMultiPoint(g.getMultiPoint(), &i);
+            const auto &hash = hash128(_dangling);
+            auto &dedup = _dedup[hash.first & (_dedup.size() - 1)];
+
+            if (dedup.h1 == hash.first && dedup.h2 == hash.second &&
+                dedup.id != std::numeric_limits<ID_TYPE>::max()) {
+              reuseGeom(dedup.id);
+              _dedupHits++;
+            } else {
+              const char *s = 0;
+              auto wktType = util::geo::getWKTType(_dangling.c_str(), &s);
+              size_t i = 0;
+
+              if (wktType != util::geo::WKTType::COLLECTION &&
+                  wktType != util::geo::WKTType::NONE && addWkt(wktType, &i)) {
+                // parsed without intermediate geometry objects
+              } else if (wktType == util::geo::WKTType::COLLECTION) {
+                _curUniqueGeom++;
+                const auto &coll =
+                    util::geo::collectionFromWKTProj<double>(s, 0, &projD);
+
+                for (const auto &g : coll) {
+                  if (g.getType() == 0) addMultiPoint({g.getPoint()}, &i);
+                  if (g.getType() == 1) addLineString(g.getLine(), &i);
+                  if (g.getType() == 2) addPolygon(g.getPolygon(), &i);
+                  if (g.getType() == 3) {
+                    addMultiLineString(g.getMultiLine(), &i);
+                  }
+                  if (g.getType() == 4) {
+                    addMultiPolygon(g.getMultiPolygon(), &i);
+                  }
+                  if (g.getType() == 6) addMultiPoint(g.getMultiPoint(), &i);
+                }
+              } else if (wktType == util::geo::WKTType::MULTIPOINT) {
+                _curUniqueGeom++;
+                const auto &mp = multiPointFromWKTProj<double>(s, 0, &projD);
+                addMultiPoint(mp, &i);
+              } else if (wktType == util::geo::WKTType::POINT) {
+                _curUniqueGeom++;
+                const auto &mp = multiPointFromWKTProj<double>(s, 0, &projD);
+                addMultiPoint(mp, &i);
+              } else if (wktType == util::geo::WKTType::MULTILINESTRING) {
+                _curUniqueGeom++;
+                const auto &ml = multiLineFromWKTProj<double>(s, 0, &projD);
+                addMultiLineString(ml, &i);
+              } else if (wktType == util::geo::WKTType::LINESTRING) {
+                _curUniqueGeom++;
+                const auto &l = lineFromWKTProj<double>(s, 0, &projD);
+                addLineString(l, &i);
+              } else if (wktType == util::geo::WKTType::MULTIPOLYGON) {
+                _curUniqueGeom++;
+                const auto &mp = multiPolygonFromWKTProj<double>(s, 0, &projD);
+                addMultiPolygon(mp, &i);
+              } else if (wktType == util::geo::WKTType::POLYGON) {
+                _curUniqueGeom++;
+                const auto &poly = polygonFromWKTProj<double>(s, 0, &projD);
+                addPolygon(poly, &i);
               }
-            } else if (wktType == util::geo::WKTType::MULTIPOINT) {
-              _curUniqueGeom++;
-              const auto &mp = multiPointFromWKTProj<double>(s, 0, &projD);
-              addMultiPoint(mp, &i);
-            } else if (wktType == util::geo::WKTType::POINT) {
-              _curUniqueGeom++;
-              const auto &mp = multiPointFromWKTProj<double>(s, 0, &projD);
-              addMultiPoint(mp, &i);
-            } else if (wktType == util::geo::WKTType::MULTILINESTRING) {
-              _curUniqueGeom++;
-              const auto &ml = multiLineFromWKTProj<double>(s, 0, &projD);
-              addMultiLineString(ml, &i);
-            } else if (wktType == util::geo::WKTType::LINESTRING) {
-              _curUniqueGeom++;
-              const auto &l = lineFromWKTProj<double>(s, 0, &projD);
-              addLineString(l, &i);
-            } else if (wktType == util::geo::WKTType::MULTIPOLYGON) {
-              _curUniqueGeom++;
-              const auto &mp = multiPolygonFromWKTProj<double>(s, 0, &projD);
-              addMultiPolygon(mp, &i);
-            } else if (wktType == util::geo::WKTType::POLYGON) {
-              _curUniqueGeom++;
-              const auto &poly = polygonFromWKTProj<double>(s, 0, &projD);
-              addPolygon(poly, &i);
-            }
 
-            // dummy element to keep sync
-            if (i == 0) {
-              IdMapping idm{0, std::numeric_limits<ID_TYPE>::max()};
-              _lastQidToId = idm;
-              _qidToIdF.write(reinterpret_cast<const char *>(&idm),
-                              sizeof(IdMapping));
-              _qidToIdFSize++;
+              // dummy element to keep sync
+              if (i == 0) {
+                IdMapping idm{0, std::numeric_limits<ID_TYPE>::max()};
+                _lastQidToId = idm;
+                _qidToIdF.write(reinterpret_cast<const char *>(&idm),
+                                sizeof(IdMapping));
+                _qidToIdFSize++;
+              }
+
+              // multi-part geometries are not re-used, see above
+              if (i == 1) dedup = {hash.first, hash.second, _lastQidToId.id};
             }
           }
 
@@ -278,6 +400,14 @@ void GeomCache::parse(const char *c, size_t size) {
   }
 }
 
+// _____________________________________________________________________________
+void GeomCache::reuseGeom(ID_TYPE id) {
+  IdMapping idm{0, id};
+  _lastQidToId = idm;
+  _qidToIdF.write(reinterpret_cast<const char *>(&idm), sizeof(IdMapping));
+  _qidToIdFSize++;
+}
+
 // _____________________________________________________________________________
 double GeomCache::getLoadStatusPercent(bool total) {
   /*
@@ -406,6 +536,15 @@ size_t GeomCache::requestSize() {
   _raw.clear();
   _raw.reserve(1000);
 
+  if (_dumpTsv.size()) {
+    // one row per line after the header
+    std::ifstream f(_dumpTsv, std::ios::binary);
+    if (!f.good()) throw std::runtime_error("Could not open " + _dumpTsv);
+    size_t ret = std::count(std::istreambuf_iterator<char>(f),
+                            std::istreambuf_iterator<char>(), '\n');
+    return ret > 0 ? ret - 1 : 0;
+  }
+
   CURLcode res;
   char errbuf[CURL_ERROR_SIZE];
 
@@ -478,6 +617,12 @@ void GeomCache::requestPart(size_t offset) {
   _lastReceivedTime = TIME();
   _lastBytesReceived = 0;
 
+  if (_dumpTsv.size()) {
+    // the dump holds the complete result
+    if (offset == 0) readDump(_dumpTsv, &GeomCache::parse);
+    return;
+  }
+
   CURLcode res;
   char errbuf[CURL_ERROR_SIZE];
 
@@ -533,6 +678,8 @@ void GeomCache::requestPart(size_t offset) {
 
 // _____________________________________________________________________________
 void GeomCache::request() {
+  joinLinesLoader();
+  unmapSections();
   _totalSize = requestSize();
   _geometryDuplicates = 0;
 
@@ -545,46 +692,27 @@ void GeomCache::request() {
   _state = IN_HEADER;
   _points.clear();
   _lines.clear();
+  _linesHi.clear();
+  _lineBoxes.clear();
   _linePoints.clear();
+  _lineBytes.clear();
   _qidToId.clear();
+  _qids.clear();
+  _ids.clear();
+  _lineCache.clear();
+  _mem.releaseAll();
+
+  {
+    std::lock_guard<std::mutex> guard(_columnsM);
+    _columns.clear();
+    _columnsLru.clear();
+  }
 
   _lastQidToId = {-1, -1};
 
   _raw.clear();
   _raw.reserve(1000);
 
-  char *pointsFName = strdup("pointsXXXXXX");
-  int i = mkstemp(pointsFName);
-  if (i == -1) throw std::runtime_error("Could not create temporary file");
-  _pointsF.open(pointsFName, std::ios::out | std::ios::in | std::ios::binary);
-
-  char *linePointsFName = strdup("linepointsXXXXXX");
-  i = mkstemp(linePointsFName);
-  if (i == -1) throw std::runtime_error("Could not create temporary file");
-  _linePointsF.open(linePointsFName,
-                    std::ios::out | std::ios::in | std::ios::binary);
-
-  char *linesFName = strdup("linesXXXXXX");
-  i = mkstemp(linesFName);
-  if (i == -1) throw std::runtime_error("Could not create temporary file");
-  _linesF.open(linesFName, std::ios::out | std::ios::in | std::ios::binary);
-
-  char *qidToIdFName = strdup("qidtoidXXXXXX");
-  i = mkstemp(qidToIdFName);
-  if (i == -1) throw std::runtime_error("Could not create temporary file");
-  _qidToIdF.open(qidToIdFName, std::ios::out | std::ios::in | std::ios::binary);
-
-  // immediately unlink
-  unlink(pointsFName);
-  unlink(linePointsFName);
-  unlink(linesFName);
-  unlink(qidToIdFName);
-
-  free(pointsFName);
-  free(linePointsFName);
-  free(linesFName);
-  free(qidToIdFName);
-
   _pointsFSize = 0;
   _linePointsFSize = 0;
   _linesFSize = 0;
@@ -592,6 +720,30 @@ void GeomCache::request() {
 
   _curRow = 0;
   _curUniqueGeom = 0;
+  _prev.clear();
+
+  if (readCheckpoint()) {
+    LOG(INFO) << "[GEOMCACHE] Resuming interrupted build at row " << _curRow;
+  }
+
+  openBuildFile(&_pointsF, "points",
+                sizeof(util::geo::Point<int32_t>) * _pointsFSize);
+  openBuildFile(&_linePointsF, "linepoints",
+                (_compressLines ? 1 : sizeof(util::geo::Point<int16_t>)) *
+                    _linePointsFSize);
+  openBuildFile(&_linesF, "lines", sizeof(size_t) * _linesFSize);
+  openBuildFile(&_qidToIdF, "qidtoid", sizeof(IdMapping) * _qidToIdFSize);
+  openBuildFile(&_lineBoxesF, "lineboxes",
+                sizeof(util::geo::Box<int32_t>) * _linesFSize);
+
+  size_t dedupBytes = sizeof(DedupEntry) << DEDUP_TABLE_BITS;
+  _mem.reserve(dedupBytes);
+  _dedup.assign(static_cast<size_t>(1) << DEDUP_TABLE_BITS,
+                {0, 0, std::numeric_limits<ID_TYPE>::max()});
+  _adjacentHits = 0;
+  _dedupHits = 0;
+  _wktFallbacks = 0;
+  size_t firstRow = _curRow;
 
   size_t lastNum = -1;
 
@@ -602,6 +754,7 @@ void GeomCache::request() {
     size_t offset = _curRow;
     requestPart(offset);
     lastNum = _curRow - offset;
+    if (lastNum) writeCheckpoint();
   }
 
   LOG(INFO) << "[GEOMCACHE] Received " << _curRow << " rows";
@@ -612,28 +765,68 @@ void GeomCache::request() {
     LOG(WARN) << "Last answer from QLever began with " << _raw;
   }
 
-  if (i == -1) throw std::runtime_error("Could not create temporary file");
+  size_t rows = _curRow - firstRow;
+  size_t hits = _adjacentHits + _dedupHits;
+  LOG(INFO) << "[GEOMCACHE] Re-used the geometry of " << hits << " of " << rows
+            << " rows (" << std::fixed << std::setprecision(2)
+            << (rows ? 100.0 * hits / rows : 0.0) << "%), " << _adjacentHits
+            << " from the previous row, " << _dedupHits
+            << " from the dedup table";
+  LOG(INFO) << "[GEOMCACHE] " << _wktFallbacks
+            << " geometries needed the generic WKT parser";
+
+  std::vector<DedupEntry>().swap(_dedup);
+  _mem.release(dedupBytes);
 
   LOG(INFO) << "[GEOMCACHE] Building vectors...";
 
+  _mem.reserve(sizeof(util::geo::Point<int32_t>) * _pointsFSize +
+               (_compressLines ? 1 : sizeof(util::geo::Point<int16_t>)) *
+                   _linePointsFSize +
+               (sizeof(uint32_t) + sizeof(uint8_t) +
+                sizeof(util::geo::Box<int32_t>)) *
+                   _linesFSize +
+               sizeof(IdMapping) * _qidToIdFSize);
+
   _points.resize(_pointsFSize);
   _pointsF.seekg(0);
   _pointsF.read(reinterpret_cast<char *>(&_points[0]),
-                sizeof(util::geo::FPoint) * _pointsFSize);
+                sizeof(util::geo::Point<int32_t>) * _pointsFSize);
   _pointsF.close();
 
-  _linePoints.resize(_linePointsFSize);
   _linePointsF.seekg(0);
-  _linePointsF.read(reinterpret_cast<char *>(&_linePoints[0]),
-                    sizeof(util::geo::Point<int16_t>) * _linePointsFSize);
+  if (_compressLines) {
+    _lineBytes.resize(_linePointsFSize);
+    _linePointsF.read(reinterpret_cast<char *>(&_lineBytes[0]),
+                      _linePointsFSize);
+  } else {
+    _linePoints.resize(_linePointsFSize);
+    _linePointsF.read(reinterpret_cast<char *>(&_linePoints[0]),
+                      sizeof(util::geo::Point<int16_t>) * _linePointsFSize);
+  }
   _linePointsF.close();
 
+  // split the line offsets into their lower 32 and upper 8 bits
   _lines.resize(_linesFSize);
+  _linesHi.resize(_linesFSize);
   _linesF.seekg(0);
-  _linesF.read(reinterpret_cast<char *>(&_lines[0]),
-               sizeof(size_t) * _linesFSize);
+  std::vector<size_t> buf(1024 * 1024);
+  for (size_t i = 0; i < _linesFSize; i += buf.size()) {
+    size_t n = std::min(buf.size(), _linesFSize - i);
+    _linesF.read(reinterpret_cast<char *>(&buf[0]), sizeof(size_t) * n);
+    for (size_t j = 0; j < n; j++) {
+      _lines[i + j] = buf[j] & 0xFFFFFFFF;
+      _linesHi[i + j] = buf[j] >> 32;
+    }
+  }
   _linesF.close();
 
+  _lineBoxes.resize(_linesFSize);
+  _lineBoxesF.seekg(0);
+  _lineBoxesF.read(reinterpret_cast<char *>(&_lineBoxes[0]),
+                   sizeof(util::geo::Box<int32_t>) * _linesFSize);
+  _lineBoxesF.close();
+
   _qidToId.resize(_qidToIdFSize);
   _qidToIdF.seekg(0);
   _qidToIdF.read(reinterpret_cast<char *>(&_qidToId[0]),
@@ -647,6 +840,158 @@ void GeomCache::request() {
             << _lines.size() << " lines";
 }
 
+// _____________________________________________________________________________
+void GeomCache::openBuildFile(std::fstream *f, const std::string &name,
+                              size_t bytes) {
+  if (_buildFile.empty()) {
+    // anonymous temporary file
+    char *fname = strdup((name + "XXXXXX").c_str());
+    int i = mkstemp(fname);
+    if (i == -1) {
+      free(fname);
+      throw std::runtime_error("Could not create temporary file");
+    }
+    f->open(fname, std::ios::out | std::ios::in | std::ios::binary);
+
+    // immediately unlink
+    unlink(fname);
+    close(i);
+    free(fname);
+    return;
+  }
+
+  // named file next to the cache file, cut back to the last checkpoint
+  std::string fname = _buildFile + "." + name;
+  std::ofstream(fname, std::ios::app | std::ios::binary).close();
+  if (truncate(fname.c_str(), bytes) != 0) {
+    throw std::runtime_error("Could not create build file " + fname);
+  }
+  f->open(fname, std::ios::out | std::ios::in | std::ios::binary);
+  f->seekp(0, std::ios::end);
+  if (!f->good()) {
+    throw std::runtime_error("Could not open build file " + fname);
+  }
+}
+
+// _____________________________________________________________________________
+void GeomCache::writeCheckpoint() {
+  if (_buildFile.empty()) return;
+
+  _pointsF.flush();
+  _linePointsF.flush();
+  _linesF.flush();
+  _qidToIdF.flush();
+  _lineBoxesF.flush();
+
+  std::string fname = _buildFile + ".checkpoint";
+  std::ofstream f(fname + ".tmp", std::ios::binary);
+
+  std::string h = _indexHash;
+  h.insert(h.end(), 99 - h.size(), ' ');
+  f.write(h.c_str(), 100);
+
+  uint8_t compressLines = _compressLines;
+  size_t curRow = _curRow;
+  size_t prevSize = _prev.size();
+  f.write(reinterpret_cast<const char *>(&compressLines), sizeof(uint8_t));
+  f.write(reinterpret_cast<const char *>(&curRow), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_curUniqueGeom), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_pointsFSize), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_linePointsFSize), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_linesFSize), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_qidToIdFSize), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(&_lastQidToId), sizeof(IdMapping));
+  f.write(reinterpret_cast<const char *>(&prevSize), sizeof(size_t));
+  f.write(_prev.c_str(), prevSize);
+  f.close();
+
+  // a failed checkpoint only costs the progress since the last one
+  if (!f.good() || rename((fname + ".tmp").c_str(), fname.c_str()) != 0) {
+    LOG(WARN) << "[GEOMCACHE] Could not write checkpoint " << fname;
+    unlink((fname + ".tmp").c_str());
+    return;
+  }
+
+  LOG(INFO) << "[GEOMCACHE] Checkpoint at row " << _curRow;
+}
+
+// _____________________________________________________________________________
+bool GeomCache::readCheckpoint() {
+  if (_buildFile.empty()) return false;
+
+  std::ifstream f(_buildFile + ".checkpoint", std::ios::binary);
+  if (!f.good()) return false;
+
+  char tmp[100];
+  f.read(tmp, 100);
+  tmp[99] = 0;
+
+  uint8_t compressLines = 0;
+  size_t curRow = 0, curUniqueGeom = 0, pointsFSize = 0, linePointsFSize = 0,
+         linesFSize = 0, qidToIdFSize = 0, prevSize = 0;
+  IdMapping lastQidToId;
+  f.read(reinterpret_cast<char *>(&compressLines), sizeof(uint8_t));
+  f.read(reinterpret_cast<char *>(&curRow), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&curUniqueGeom), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&pointsFSize), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&linePointsFSize), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&linesFSize), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&qidToIdFSize), sizeof(size_t));
+  f.read(reinterpret_cast<char *>(&lastQidToId), sizeof(IdMapping));
+  f.read(reinterpret_cast<char *>(&prevSize), sizeof(size_t));
+  std::string prev(f.good() ? prevSize : 0, 0);
+  f.read(&prev[0], prev.size());
+
+  if (!f.good() || util::trim(tmp) != _indexHash ||
+      static_cast<bool>(compressLines) != _compressLines) {
+    LOG(INFO) << "[GEOMCACHE] Discarding checkpoint of a different build";
+    removeBuildFiles();
+    return false;
+  }
+
+  // the build files must at least reach the checkpoint
+  auto reaches = [this](const std::string &name, size_t bytes) {
+    struct stat st;
+    std::string fname = _buildFile + "." + name;
+    return stat(fname.c_str(), &st) == 0 &&
+           static_cast<size_t>(st.st_size) >= bytes;
+  };
+
+  if (!reaches("points", sizeof(util::geo::Point<int32_t>) * pointsFSize) ||
+      !reaches("linepoints",
+               (_compressLines ? 1 : sizeof(util::geo::Point<int16_t>)) *
+                   linePointsFSize) ||
+      !reaches("lines", sizeof(size_t) * linesFSize) ||
+      !reaches("qidtoid", sizeof(IdMapping) * qidToIdFSize) ||
+      !reaches("lineboxes", sizeof(util::geo::Box<int32_t>) * linesFSize)) {
+    LOG(WARN) << "[GEOMCACHE] Build files are shorter than the checkpoint, "
+                 "discarding it";
+    removeBuildFiles();
+    return false;
+  }
+
+  _curRow = curRow;
+  _curUniqueGeom = curUniqueGeom;
+  _pointsFSize = pointsFSize;
+  _linePointsFSize = linePointsFSize;
+  _linesFSize = linesFSize;
+  _qidToIdFSize = qidToIdFSize;
+  _lastQidToId = lastQidToId;
+  _prev = std::move(prev);
+
+  return true;
+}
+
+// _____________________________________________________________________________
+void GeomCache::removeBuildFiles() {
+  if (_buildFile.empty()) return;
+
+  for (const char *name : {"points", "linepoints", "lines", "qidtoid",
+                           "lineboxes", "checkpoint"}) {
+    unlink((_buildFile + "." + name).c_str());
+  }
+}
+
 // _____________________________________________________________________________
 void GeomCache::requestIds() {
   _loadStatusStage = _LoadStatusStages::ParseIds;
@@ -682,10 +1027,26 @@ void GeomCache::requestIds() {
   LOG(INFO) << "[GEOMCACHE] Sorting results by qlever ID...";
   std::stable_sort(_qidToId.begin(), _qidToId.end());
   LOG(INFO) << "[GEOMCACHE] ... done";
+
+  // split into separate qid and id arrays, the padded mappings are only
+  // needed during the build
+  _mem.reserve((sizeof(QLEVER_ID_TYPE) + sizeof(ID_TYPE)) * _qidToId.size());
+  _qids.resize(_qidToId.size());
+  _ids.resize(_qidToId.size());
+  for (size_t i = 0; i < _qidToId.size(); i++) {
+    _qids[i] = _qidToId[i].qid;
+    _ids[i] = _qidToId[i].id;
+  }
+  std::vector<IdMapping>().swap(_qidToId);
 }
 
 // _____________________________________________________________________________
 void GeomCache::requestIdPart(size_t offset) {
+  if (_dumpIds.size()) {
+    if (offset == 0) readDump(_dumpIds, &GeomCache::parseIds);
+    return;
+  }
+
   CURLcode res;
   char errbuf[CURL_ERROR_SIZE];
 
@@ -738,6 +1099,20 @@ void GeomCache::requestIdPart(size_t offset) {
   }
 }
 
+// _____________________________________________________________________________
+void GeomCache::readDump(const std::string &fname,
+                         void (GeomCache::*parseFn)(const char *, size_t)) {
+  std::ifstream f(fname, std::ios::binary);
+  if (!f.good()) throw std::runtime_error("Could not open " + fname);
+
+  LOG(INFO) << "[GEOMCACHE] Reading dump " << fname;
+
+  std::vector<char> buf(16 * 1024 * 1024);
+  while (f.read(buf.data(), buf.size()) || f.gcount() > 0) {
+    (this->*parseFn)(buf.data(), f.gcount());
+  }
+}
+
 // _____________________________________________________________________________
 std::string GeomCache::queryUrl(std::string query, size_t offset,
                                 size_t limit) const {
@@ -775,9 +1150,9 @@ void GeomCache::addMultiPoint(const util::geo::MultiPoint<double> &mp,
                               size_t *i) {
   for (const auto &point : mp) {
     if (pointValid(point)) {
-      FPoint fpoint{point.getX(), point.getY()};
+      auto fpoint = toFixed(point);
       _pointsF.write(reinterpret_cast<const char *>(&fpoint),
-                     sizeof(util::geo::FPoint));
+                     sizeof(util::geo::Point<int32_t>));
       _pointsFSize++;
       if (_pointsFSize >= I_OFFSET) {
         std::stringstream ss;
@@ -844,11 +1219,16 @@ void GeomCache::addMultiPolygon(const util::geo::MultiPolygon<double> &mp,
 
 // _____________________________________________________________________________
 void GeomCache::addLineString(const util::geo::Line<double> &line, size_t *i) {
+  addLine(line, false, i);
+}
+
+// _____________________________________________________________________________
+void GeomCache::addLine(const util::geo::DLine &line, bool isArea, size_t *i) {
   if (line.size() != 0) {
     _linesF.write(reinterpret_cast<const char *>(&_linePointsFSize),
                   sizeof(size_t));
     _linesFSize++;
-    insertLine(line, false);
+    insertLine(line, isArea);
 
     if (_linesFSize - 1 >= std::numeric_limits<ID_TYPE>::max() - I_OFFSET) {
       std::stringstream ss;
@@ -865,6 +1245,37 @@ void GeomCache::addLineString(const util::geo::Line<double> &line, size_t *i) {
   }
 }
 
+// _____________________________________________________________________________
+bool GeomCache::addWkt(util::geo::WKTType type, size_t *i) {
+  if (!parseWktCoords(_dangling.data(), _dangling.size(), type, &_wkt)) {
+    _wktFallbacks++;
+    return false;
+  }
+
+  for (auto &p : _wkt.points) p = projD(p);
+
+  _curUniqueGeom++;
+
+  if (type == util::geo::WKTType::POINT ||
+      type == util::geo::WKTType::MULTIPOINT) {
+    addMultiPoint(_wkt.points, i);
+    return true;
+  }
+
+  // rings are added as written, like the generic parser does
+  bool isArea = type == util::geo::WKTType::POLYGON ||
+                type == util::geo::WKTType::MULTIPOLYGON;
+
+  size_t start = 0;
+  for (size_t end : _wkt.ends) {
+    _wktLine.assign(_wkt.points.begin() + start, _wkt.points.begin() + end);
+    addLine(_wktLine, isArea, i);
+    start = end;
+  }
+
+  return true;
+}
+
 // _____________________________________________________________________________
 void GeomCache::addMultiLineString(const util::geo::MultiLine<double> &ml,
                                    size_t *i) {
@@ -951,34 +1362,34 @@ GeomCache::getRelObjects(const std::vector<IdMapping> &ids) const {
   size_t i = 0;
   size_t j = 0;
 
-  while (i < ids.size() && j < _qidToId.size()) {
-    if (ids[i].qid == _qidToId[j].qid) {
+  while (i < ids.size() && j < _qids.size()) {
+    if (ids[i].qid == _qids[j]) {
       size_t prefJ = j;
 
-      while (j < _qidToId.size() && ids[i].qid == _qidToId[j].qid) {
+      while (j < _qids.size() && ids[i].qid == _qids[j]) {
         if (ret.size() == 0 || ret.back().second != ids[i].id) numObjects++;
-        ret.push_back({_qidToId[j].id, ids[i].id});
+        ret.push_back({_ids[j], ids[i].id});
         j++;
       }
 
       j = prefJ;
       i++;
-    } else if (ids[i].qid < _qidToId[j].qid) {
+    } else if (ids[i].qid < _qids[j]) {
       i++;
     } else {
       size_t gallop = 1;
       do {
-        if (j + gallop >= _qidToId.size()) {
-          j = std::lower_bound(_qidToId.begin() + j + gallop / 2,
-                               _qidToId.end(), ids[i]) -
-              _qidToId.begin();
+        if (j + gallop >= _qids.size()) {
+          j = std::lower_bound(_qids.begin() + j + gallop / 2, _qids.end(),
+                               ids[i].qid) -
+              _qids.begin();
           break;
         }
 
-        if (_qidToId[j + gallop].qid >= ids[i].qid) {
-          j = std::lower_bound(_qidToId.begin() + j + gallop / 2,
-                               _qidToId.begin() + j + gallop, ids[i]) -
-              _qidToId.begin();
+        if (_qids[j + gallop] >= ids[i].qid) {
+          j = std::lower_bound(_qids.begin() + j + gallop / 2,
+                               _qids.begin() + j + gallop, ids[i].qid) -
+              _qids.begin();
           break;
         }
 
@@ -993,143 +1404,319 @@ GeomCache::getRelObjects(const std::vector<IdMapping> &ids) const {
 
 // _____________________________________________________________________________
 void GeomCache::insertLine(const util::geo::DLine &l, bool isArea) {
-  // we also add the line's bounding box here to also
-  // compress that
+  if (_linePointsFSize >= MAX_LINE_POINTS) {
+    std::stringstream ss;
+    ss << "Maximum size of line point data (" << MAX_LINE_POINTS
+       << ") exceeded.";
+    throw std::runtime_error(ss.str());
+  }
+
+  // the bounding box is stored separately, in fixed point with the same
+  // precision as the line points, rounded outwards
   const auto &bbox = util::geo::getBoundingBox(l);
+  util::geo::Box<int32_t> qbox(
+      {static_cast<int32_t>(std::floor(bbox.getLowerLeft().getX() * 10.0)),
+       static_cast<int32_t>(std::floor(bbox.getLowerLeft().getY() * 10.0))},
+      {static_cast<int32_t>(std::ceil(bbox.getUpperRight().getX() * 10.0)),
+       static_cast<int32_t>(std::ceil(bbox.getUpperRight().getY() * 10.0))});
+  _lineBoxesF.write(reinterpret_cast<const char *>(&qbox),
+                    sizeof(util::geo::Box<int32_t>));
+
+  if (_compressLines) {
+    _varintBuf.clear();
+    encodeVarintLinePoints(l, isArea, &_varintBuf);
+    _linePointsF.write(reinterpret_cast<const char *>(&_varintBuf[0]),
+                       _varintBuf.size());
+    _linePointsFSize += _varintBuf.size();
+  } else {
+    _lineBuf.clear();
+    encodeLinePoints(l, isArea, &_lineBuf);
+    _linePointsF.write(reinterpret_cast<const char *>(&_lineBuf[0]),
+                       sizeof(util::geo::Point<int16_t>) * _lineBuf.size());
+    _linePointsFSize += _lineBuf.size();
+  }
+}
 
-  int16_t mainX = (bbox.getLowerLeft().getX() * 10.0) / M_COORD_GRANULARITY;
-  int16_t mainY = (bbox.getLowerLeft().getY() * 10.0) / M_COORD_GRANULARITY;
-
-  if (mainX != 0 || mainY != 0) {
-    util::geo::Point<int16_t> p{mCoord(mainX), mCoord(mainY)};
-    _linePointsF.write(reinterpret_cast<const char *>(&p),
-                       sizeof(util::geo::Point<int16_t>));
-    _linePointsFSize++;
-  }
-
-  // add bounding box lower left
-  int16_t minorXLoc =
-      (bbox.getLowerLeft().getX() * 10.0) - mainX * M_COORD_GRANULARITY;
-  int16_t minorYLoc =
-      (bbox.getLowerLeft().getY() * 10.0) - mainY * M_COORD_GRANULARITY;
-
-  util::geo::Point<int16_t> p{minorXLoc, minorYLoc};
-  _linePointsF.write(reinterpret_cast<const char *>(&p),
-                     sizeof(util::geo::Point<int16_t>));
-  _linePointsFSize++;
-
-  // add bounding box upper left
-  int16_t mainXLoc = (bbox.getUpperRight().getX() * 10.0) / M_COORD_GRANULARITY;
-  int16_t mainYLoc = (bbox.getUpperRight().getY() * 10.0) / M_COORD_GRANULARITY;
-  minorXLoc =
-      (bbox.getUpperRight().getX() * 10.0) - mainXLoc * M_COORD_GRANULARITY;
-  minorYLoc =
-      (bbox.getUpperRight().getY() * 10.0) - mainYLoc * M_COORD_GRANULARITY;
-  if (mainXLoc != mainX || mainYLoc != mainY) {
-    mainX = mainXLoc;
-    mainY = mainYLoc;
-
-    util::geo::Point<int16_t> p{mCoord(mainX), mCoord(mainY)};
-    _linePointsF.write(reinterpret_cast<const char *>(&p),
-                       sizeof(util::geo::Point<int16_t>));
-    _linePointsFSize++;
-  }
-  p = util::geo::Point<int16_t>{minorXLoc, minorYLoc};
-  _linePointsF.write(reinterpret_cast<const char *>(&p),
-                     sizeof(util::geo::Point<int16_t>));
-  _linePointsFSize++;
-
-  // add line points
-  for (const auto &p : l) {
-    mainXLoc = (p.getX() * 10.0) / M_COORD_GRANULARITY;
-    mainYLoc = (p.getY() * 10.0) / M_COORD_GRANULARITY;
-
-    if (mainXLoc != mainX || mainYLoc != mainY) {
-      mainX = mainXLoc;
-      mainY = mainYLoc;
-
-      util::geo::Point<int16_t> p{mCoord(mainX), mCoord(mainY)};
-      _linePointsF.write(reinterpret_cast<const char *>(&p),
-                         sizeof(util::geo::Point<int16_t>));
-      _linePointsFSize++;
-    }
+// _____________________________________________________________________________
+petrimaps::LineGeomPtr GeomCache::getLineGeom(size_t lid) const {
+  size_t key = lineCacheKey(lid, NUM_LODS);
+  auto ret = _lineCache.get(key);
+  if (ret) return ret;
+
+  util::geo::DLine dline;
+  decodeLine(lid, &dline);
+  ret = std::make_shared<const util::geo::DLine>(std::move(dline));
+  _lineCache.put(key, ret);
+  return ret;
+}
+
+// _____________________________________________________________________________
+bool GeomCache::getLod(size_t lid, double res, size_t *level,
+                       size_t *i) const {
+  // coarsest level whose error is below the resolution
+  *level = NUM_LODS;
+  while (*level > 0 && !(LOD_EPS[*level - 1] <= res)) (*level)--;
+  if (*level == 0) return false;
+  (*level)--;
+
+  auto it = std::lower_bound(_lodLines.begin(), _lodLines.end(), lid);
+  if (it == _lodLines.end() || *it != lid) return false;
+
+  *i = it - _lodLines.begin();
+  return true;
+}
 
-    int16_t minorXLoc = (p.getX() * 10.0) - mainXLoc * M_COORD_GRANULARITY;
-    int16_t minorYLoc = (p.getY() * 10.0) - mainYLoc * M_COORD_GRANULARITY;
+// _____________________________________________________________________________
+void GeomCache::decodeLod(size_t level, size_t i, util::geo::DLine *out) const {
+  const auto &pts = _lodPoints[level];
+  size_t start = getLodOffset(level, i);
+  size_t end = i + 1 < _lodLines.size() ? getLodOffset(level, i + 1)
+                                        : pts.size();
+
+  decodeLinePoints(&pts[0] + start, &pts[0] + end, out);
+}
 
-    util::geo::Point<int16_t> pp{minorXLoc, minorYLoc};
-    _linePointsF.write(reinterpret_cast<const char *>(&pp),
-                       sizeof(util::geo::Point<int16_t>));
-    _linePointsFSize++;
+// _____________________________________________________________________________
+petrimaps::LineGeomPtr GeomCache::getLineGeom(size_t lid, double res) const {
+  size_t level, i;
+  if (!getLod(lid, res, &level, &i)) return getLineGeom(lid);
+
+  size_t key = lineCacheKey(lid, level);
+  auto ret = _lineCache.get(key);
+  if (ret) return ret;
+
+  util::geo::DLine dline;
+  decodeLod(level, i, &dline);
+  ret = std::make_shared<const util::geo::DLine>(std::move(dline));
+  _lineCache.put(key, ret);
+  return ret;
+}
+
+// _____________________________________________________________________________
+void GeomCache::decodeLine(size_t lid, double res,
+                           util::geo::DLine *out) const {
+  size_t level, i;
+  if (getLod(lid, res, &level, &i)) {
+    decodeLod(level, i, out);
+  } else {
+    decodeLine(lid, out);
   }
+}
 
-  // add closing point for area
-  if (isArea && l.size()) {
-    const auto& p = l.front();
-    mainXLoc = (p.getX() * 10.0) / M_COORD_GRANULARITY;
-    mainYLoc = (p.getY() * 10.0) / M_COORD_GRANULARITY;
+// _____________________________________________________________________________
+void GeomCache::buildLods() {
+  LOG(INFO) << "[GEOMCACHE] Building line simplifications...";
+
+  _lodLines.clear();
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    _lodOffsets[l].clear();
+    _lodOffsetsHi[l].clear();
+    _lodPoints[l].clear();
+  }
 
-    if (mainXLoc != mainX || mainYLoc != mainY) {
-      mainX = mainXLoc;
-      mainY = mainYLoc;
+  const size_t BATCH = 64 * 1024;
+  std::vector<std::array<util::geo::DLine, NUM_LODS>> simpl(BATCH);
 
-      util::geo::Point<int16_t> p{mCoord(mainX), mCoord(mainY)};
-      _linePointsF.write(reinterpret_cast<const char *>(&p),
-                         sizeof(util::geo::Point<int16_t>));
-      _linePointsFSize++;
-    }
+  for (size_t b = 0; b < _lines.size(); b += BATCH) {
+    size_t n = std::min(BATCH, _lines.size() - b);
 
-    int16_t minorXLoc = (p.getX() * 10.0) - mainXLoc * M_COORD_GRANULARITY;
-    int16_t minorYLoc = (p.getY() * 10.0) - mainYLoc * M_COORD_GRANULARITY;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < n; i++) {
+      for (auto &line : simpl[i]) line.clear();
 
-    util::geo::Point<int16_t> pp{minorXLoc, minorYLoc};
-    _linePointsF.write(reinterpret_cast<const char *>(&pp),
-                       sizeof(util::geo::Point<int16_t>));
-    _linePointsFSize++;
-  }
+      util::geo::DLine dline;
+      decodeLine(b + i, &dline);
+      if (dline.size() < LOD_MIN_POINTS) continue;
 
-  // if we have an area, we end in a major coord (which is not possible for
-  // other types)
-  if (isArea) {
-    util::geo::Point<int16_t> p{mCoord(0), mCoord(0)};
-    _linePointsF.write(reinterpret_cast<const char *>(&p),
-                       sizeof(util::geo::Point<int16_t>));
-    _linePointsFSize++;
+      // areas keep their closing point, which Douglas-Peucker never drops
+      for (size_t l = 0; l < NUM_LODS; l++) {
+        simpl[i][l] = util::geo::simplify(dline, LOD_EPS[l]);
+      }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      if (simpl[i][0].empty()) continue;
+      _lodLines.push_back(b + i);
+      for (size_t l = 0; l < NUM_LODS; l++) {
+        _lodOffsets[l].push_back(_lodPoints[l].size());
+        _lodOffsetsHi[l].push_back(_lodPoints[l].size() >> 32);
+        encodeLinePoints(simpl[i][l], false, &_lodPoints[l]);
+      }
+    }
   }
+
+  LOG(INFO) << "[GEOMCACHE] ... done, simplified " << _lodLines.size()
+            << " lines.";
 }
 
 // _____________________________________________________________________________
-util::geo::DBox GeomCache::getLineBBox(size_t lid) const {
-  util::geo::DBox ret;
-  size_t start = getLine(lid);
+void GeomCache::sortSpatially() {
+  LOG(INFO) << "[GEOMCACHE] Sorting geometries along Hilbert curve...";
 
-  bool s = false;
+  // (hilbert key, old id)
+  std::vector<std::pair<uint32_t, ID_TYPE>> order;
 
-  double mainX = 0;
-  double mainY = 0;
-  for (size_t i = start; i < start + 4; i++) {
-    // extract real geom
-    const auto &cur = _linePoints[i];
+  // points
+  order.resize(_points.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < _points.size(); i++) {
+    order[i] = {hilbertKey(_points[i].getX() / 10.0, _points[i].getY() / 10.0),
+                i};
+  }
+  std::sort(order.begin(), order.end());
 
-    if (isMCoord(cur.getX())) {
-      mainX = rmCoord(cur.getX());
-      mainY = rmCoord(cur.getY());
-      continue;
+  std::vector<ID_TYPE> pointIds(_points.size());
+  std::vector<util::geo::Point<int32_t>> points(_points.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    points[i] = _points[order[i].second];
+    pointIds[order[i].second] = i;
+  }
+  _points.swap(points);
+  std::vector<util::geo::Point<int32_t>>().swap(points);
+
+  // lines, by the center of their bounding box
+  order.resize(_lines.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < _lines.size(); i++) {
+    const auto &b = _lineBoxes[i];
+    order[i] = {hilbertKey((b.getLowerLeft().getX() +
+                            b.getUpperRight().getX()) / 20.0,
+                           (b.getLowerLeft().getY() +
+                            b.getUpperRight().getY()) / 20.0),
+                i};
+  }
+  std::sort(order.begin(), order.end());
+
+  // each line is encoded independently of the others (major/minor lines start
+  // relative to major coordinate (0, 0)), so its data can be moved as a block
+  std::vector<ID_TYPE> lineIds(_lines.size());
+  std::vector<uint32_t> lines(_lines.size());
+  std::vector<uint8_t> linesHi(_lines.size());
+  std::vector<util::geo::Box<int32_t>> lineBoxes(_lines.size());
+
+  auto reorder = [&](auto &data) {
+    typename std::remove_reference<decltype(data)>::type newData;
+    newData.reserve(data.size());
+
+    for (size_t i = 0; i < order.size(); i++) {
+      size_t lid = order[i].second;
+      size_t off = newData.size();
+      lines[i] = off & 0xFFFFFFFF;
+      linesHi[i] = off >> 32;
+      lineBoxes[i] = _lineBoxes[lid];
+      newData.insert(newData.end(), data.begin() + getLine(lid),
+                     data.begin() + getLineEnd(lid));
+      lineIds[lid] = i;
     }
 
-    util::geo::DPoint curP((mainX * M_COORD_GRANULARITY + cur.getX()) / 10.0,
-                           (mainY * M_COORD_GRANULARITY + cur.getY()) / 10.0);
+    data.swap(newData);
+  };
 
-    if (!s) {
-      ret.setLowerLeft(curP);
-      s = true;
-    } else {
-      ret.setUpperRight(curP);
-      return ret;
+  if (_compressLines) {
+    reorder(_lineBytes);
+  } else {
+    reorder(_linePoints);
+  }
+
+  _lines.swap(lines);
+  _linesHi.swap(linesHi);
+  _lineBoxes.swap(lineBoxes);
+  std::vector<std::pair<uint32_t, ID_TYPE>>().swap(order);
+
+  // remap geometry ids
+#pragma omp parallel for
+  for (size_t i = 0; i < _ids.size(); i++) {
+    if (_ids[i] < I_OFFSET) {
+      _ids[i] = pointIds[_ids[i]];
+    } else if (_ids[i] < std::numeric_limits<ID_TYPE>::max()) {
+      _ids[i] = I_OFFSET + lineIds[_ids[i] - I_OFFSET];
     }
   }
 
-  return ret;
+  _lineCache.clear();
+
+  LOG(INFO) << "[GEOMCACHE] ... done";
+}
+
+// _____________________________________________________________________________
+bool GeomCache::getColumns(const std::string& query,
+                           std::vector<std::string>* cols) const {
+  const auto& key = hash128(normalizeSparql(query));
+
+  std::lock_guard<std::mutex> guard(_columnsM);
+  auto it = _columns.find(key);
+  if (it == _columns.end()) return false;
+  _columnsLru.splice(_columnsLru.begin(), _columnsLru, it->second);
+  *cols = it->second->second;
+  return true;
+}
+
+// _____________________________________________________________________________
+void GeomCache::setColumns(const std::string& query,
+                           const std::vector<std::string>& cols) const {
+  const auto& key = hash128(normalizeSparql(query));
+
+  std::lock_guard<std::mutex> guard(_columnsM);
+
+  auto it = _columns.find(key);
+  if (it != _columns.end()) {
+    it->second->second = cols;
+    _columnsLru.splice(_columnsLru.begin(), _columnsLru, it->second);
+    return;
+  }
+
+  while (_columns.size() >= MAX_CACHED_COLUMNS) {
+    _columns.erase(_columnsLru.back().first);
+    _columnsLru.pop_back();
+  }
+
+  _columnsLru.push_front({key, cols});
+  _columns[key] = _columnsLru.begin();
+}
+
+// _____________________________________________________________________________
+void GeomCache::accountMemory() {
+  size_t bytes = sizeof(util::geo::Point<int32_t>) * _points.size() +
+                 sizeof(util::geo::Point<int16_t>) * _linePoints.size() +
+                 _lineBytes.size() +
+                 (sizeof(uint32_t) + sizeof(uint8_t) +
+                  sizeof(util::geo::Box<int32_t>)) *
+                     _lines.size() +
+                 (sizeof(QLEVER_ID_TYPE) + sizeof(ID_TYPE)) * _qids.size() +
+                 sizeof(ID_TYPE) * _lodLines.size();
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    bytes += (sizeof(uint32_t) + sizeof(uint8_t)) * _lodOffsets[l].size() +
+             sizeof(util::geo::Point<int16_t>) * _lodPoints[l].size();
+  }
+
+  _mem.releaseAll();
+  _mem.reserve(bytes);
+}
+
+// _____________________________________________________________________________
+void GeomCache::logIndexMemory() const {
+  double lines = (sizeof(uint32_t) + sizeof(uint8_t) +
+                  sizeof(util::geo::Box<int32_t>)) *
+                 _lines.size() / (1024.0 * 1024.0);
+  double qidToId =
+      (sizeof(QLEVER_ID_TYPE) + sizeof(ID_TYPE)) * _qids.size() /
+      (1024.0 * 1024.0);
+  double geoms = (sizeof(util::geo::Point<int32_t>) * _points.size() +
+                  sizeof(util::geo::Point<int16_t>) * _linePoints.size() +
+                  _lineBytes.size()) /
+                 (1024.0 * 1024.0);
+
+  double lods = sizeof(ID_TYPE) * _lodLines.size();
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    lods += (sizeof(uint32_t) + sizeof(uint8_t)) * _lodOffsets[l].size() +
+            sizeof(util::geo::Point<int16_t>) * _lodPoints[l].size();
+  }
+  lods /= 1024.0 * 1024.0;
+
+  LOG(INFO) << "[GEOMCACHE] Memory: " << std::fixed << std::setprecision(2)
+            << geoms << " MB geometries, " << lines << " MB line index, "
+            << qidToId << " MB qlever ID mapping, " << lods
+            << " MB line simplifications";
 }
 
 // _____________________________________________________________________________
@@ -1144,10 +1731,31 @@ std::string GeomCache::indexHashFromDisk(const std::string &fname) {
 
 // _____________________________________________________________________________
 void GeomCache::fromDisk(const std::string &fname) {
+  joinLinesLoader();
+  unmapSections();
   _loadStatusStage = _LoadStatusStages::FromFile;
   _points.clear();
   _linePoints.clear();
+  _lineBytes.clear();
   _lines.clear();
+  _linesHi.clear();
+  _lineBoxes.clear();
+  _qids.clear();
+  _ids.clear();
+  _lodLines.clear();
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    _lodOffsets[l].clear();
+    _lodOffsetsHi[l].clear();
+    _lodPoints[l].clear();
+  }
+  _lineCache.clear();
+  _mem.releaseAll();
+
+  {
+    std::lock_guard<std::mutex> guard(_columnsM);
+    _columns.clear();
+    _columnsLru.clear();
+  }
 
   std::ifstream f(fname, std::ios::binary);
 
@@ -1157,6 +1765,10 @@ void GeomCache::fromDisk(const std::string &fname) {
   tmp[99] = 0;
   _indexHash = util::trim(tmp);
 
+  f.read(tmp, 100);
+  tmp[99] = 0;
+  _buildId = util::trim(tmp);
+
   size_t numPoints;
   size_t numLinePoints;
   size_t numLines;
@@ -1164,74 +1776,278 @@ void GeomCache::fromDisk(const std::string &fname) {
   std::streampos posPoints;
   std::streampos posLinePoints;
   std::streampos posLines;
-  std::streampos posQidToId;
+  std::streampos posLinesHi;
+  std::streampos posLineBoxes;
+  std::streampos posQids;
+  std::streampos posIds;
+  std::streampos posLods;
 
   // get total num points
   // points
   f.read(reinterpret_cast<char *>(&numPoints), sizeof(size_t));
 
+  _mem.reserve(sizeof(util::geo::Point<int32_t>) * numPoints);
   _points.resize(numPoints);
-  posPoints = f.tellg();
-  f.seekg(sizeof(util::geo::FPoint) * numPoints, f.cur);
+  posPoints = alignRead(&f);
+  f.seekg(sizeof(util::geo::Point<int32_t>) * numPoints, f.cur);
 
-  // linePoints
+  // linePoints, the encoding is part of the index hash
   f.read(reinterpret_cast<char *>(&numLinePoints), sizeof(size_t));
-  _linePoints.resize(numLinePoints);
-  posLinePoints = f.tellg();
-  f.seekg(sizeof(util::geo::Point<int16_t>) * numLinePoints, f.cur);
+  posLinePoints = alignRead(&f);
+  size_t lineDataWidth =
+      _compressLines ? 1 : sizeof(util::geo::Point<int16_t>);
+  if (!_mapSections) {
+    _mem.reserve(lineDataWidth * numLinePoints);
+    if (_compressLines) {
+      _lineBytes.resize(numLinePoints);
+    } else {
+      _linePoints.resize(numLinePoints);
+    }
+  }
+  f.seekg(lineDataWidth * numLinePoints, f.cur);
 
-  // lines
+  // lines, lower 32 bits of the offsets
   f.read(reinterpret_cast<char *>(&numLines), sizeof(size_t));
+  _mem.reserve((sizeof(uint32_t) + sizeof(uint8_t)) * numLines);
   _lines.resize(numLines);
-  posLines = f.tellg();
-  f.seekg(sizeof(size_t) * numLines, f.cur);
+  posLines = alignRead(&f);
+  f.seekg(sizeof(uint32_t) * numLines, f.cur);
+
+  // lines, upper 8 bits of the offsets
+  _linesHi.resize(numLines);
+  posLinesHi = alignRead(&f);
+  f.seekg(sizeof(uint8_t) * numLines, f.cur);
+
+  // line bounding boxes, same number as lines
+  if (!_mapSections) {
+    _mem.reserve(sizeof(util::geo::Box<int32_t>) * numLines);
+    _lineBoxes.resize(numLines);
+  }
+  posLineBoxes = alignRead(&f);
+  f.seekg(sizeof(util::geo::Box<int32_t>) * numLines, f.cur);
 
-  // qidToId
+  // qidToId, qlever ids
   f.read(reinterpret_cast<char *>(&numQidToId), sizeof(size_t));
-  _qidToId.resize(numQidToId);
-  posQidToId = f.tellg();
-  f.seekg(sizeof(IdMapping) * numQidToId, f.cur);
+  _mem.reserve((sizeof(QLEVER_ID_TYPE) + sizeof(ID_TYPE)) * numQidToId);
+  _qids.resize(numQidToId);
+  posQids = alignRead(&f);
+  f.seekg(sizeof(QLEVER_ID_TYPE) * numQidToId, f.cur);
 
-  _totalSize = numPoints + numLinePoints + numLines + numQidToId;
+  // qidToId, geom ids
+  _ids.resize(numQidToId);
+  posIds = alignRead(&f);
+  f.seekg(sizeof(ID_TYPE) * numQidToId, f.cur);
+
+  // line simplifications, small enough to be read in one go below
+  posLods = f.tellg();
+
+  // without the line points, which are read in the background
+  _totalSize = numPoints + (_mapSections ? 2 : 3) * numLines + 2 * numQidToId;
   _curRow = 0;
 
   // read data from file
   // points
   f.seekg(posPoints);
   for (size_t i = 0; i < numPoints; i++) {
-    f.read(reinterpret_cast<char *>(&_points[i]), sizeof(util::geo::FPoint));
+    f.read(reinterpret_cast<char *>(&_points[i]),
+           sizeof(util::geo::Point<int32_t>));
     _curRow += 1;
   }
 
-  // linePoints
-  f.seekg(posLinePoints);
-  for (size_t i = 0; i < numLinePoints; i++) {
-    f.read(reinterpret_cast<char *>(&_linePoints[i]),
-           sizeof(util::geo::Point<int16_t>));
+  // lines
+  f.seekg(posLines);
+  for (size_t i = 0; i < numLines; i++) {
+    f.read(reinterpret_cast<char *>(&_lines[i]), sizeof(uint32_t));
     _curRow += 1;
   }
 
-  // lines
-  f.seekg(posLines);
+  f.seekg(posLinesHi);
   for (size_t i = 0; i < numLines; i++) {
-    f.read(reinterpret_cast<char *>(&_lines[i]), sizeof(size_t));
+    f.read(reinterpret_cast<char *>(&_linesHi[i]), sizeof(uint8_t));
     _curRow += 1;
   }
 
+  // line bounding boxes
+  if (!_mapSections) {
+    f.seekg(posLineBoxes);
+    for (size_t i = 0; i < numLines; i++) {
+      f.read(reinterpret_cast<char *>(&_lineBoxes[i]),
+             sizeof(util::geo::Box<int32_t>));
+      _curRow += 1;
+    }
+  }
+
   // qidToId
-  f.seekg(posQidToId);
+  f.seekg(posQids);
   for (size_t i = 0; i < numQidToId; i++) {
-    f.read(reinterpret_cast<char *>(&_qidToId[i]), sizeof(IdMapping));
+    f.read(reinterpret_cast<char *>(&_qids[i]), sizeof(QLEVER_ID_TYPE));
     _curRow += 1;
   }
 
-  f.close();
+  f.seekg(posIds);
+  for (size_t i = 0; i < numQidToId; i++) {
+    f.read(reinterpret_cast<char *>(&_ids[i]), sizeof(ID_TYPE));
+    _curRow += 1;
+  }
+
+  // line simplifications
+  f.seekg(posLods);
+  size_t numLodLines;
+  f.read(reinterpret_cast<char *>(&numLodLines), sizeof(size_t));
+  _mem.reserve(
+      (sizeof(ID_TYPE) + NUM_LODS * (sizeof(uint32_t) + sizeof(uint8_t))) *
+      numLodLines);
+  _lodLines.resize(numLodLines);
+  f.read(reinterpret_cast<char *>(_lodLines.data()),
+         sizeof(ID_TYPE) * numLodLines);
+
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    size_t numLodPoints;
+    _lodOffsets[l].resize(numLodLines);
+    f.read(reinterpret_cast<char *>(_lodOffsets[l].data()),
+           sizeof(uint32_t) * numLodLines);
+    _lodOffsetsHi[l].resize(numLodLines);
+    f.read(reinterpret_cast<char *>(_lodOffsetsHi[l].data()),
+           sizeof(uint8_t) * numLodLines);
+    f.read(reinterpret_cast<char *>(&numLodPoints), sizeof(size_t));
+    _mem.reserve(sizeof(util::geo::Point<int16_t>) * numLodPoints);
+    _lodPoints[l].resize(numLodPoints);
+    f.read(reinterpret_cast<char *>(_lodPoints[l].data()),
+           sizeof(util::geo::Point<int16_t>) * numLodPoints);
+  }
+
+  logIndexMemory();
+
+  if (_mapSections) {
+    _numMappedLineData = numLinePoints;
+    _numMappedLines = numLines;
+    mapSections(fname, posLinePoints, posLineBoxes);
+    return;
+  }
+
+  // the line points are by far the largest section, they are read in the
+  // background from the already open file (which may be replaced by a
+  // rebuild in the meantime)
+  _linesReady = false;
+  _linesFailed = false;
+  f.seekg(posLinePoints);
+  _linesLoader = std::thread(&GeomCache::linePointsFromDisk, this,
+                             std::move(f), numLinePoints);
+}
+
+// _____________________________________________________________________________
+void GeomCache::mapSections(const std::string &fname, size_t posLineData,
+                            size_t posLineBoxes) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1) throw std::runtime_error("Could not open " + fname);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat " + fname);
+  }
+
+  // the mapping stays valid after the file was closed or replaced
+  void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) throw std::runtime_error("Could not map " + fname);
+
+  _map = map;
+  _mapLen = st.st_size;
+  _mappedLineData = static_cast<const char *>(_map) + posLineData;
+  _mappedLineBoxes = static_cast<const char *>(_map) + posLineBoxes;
+
+  // lines are accessed by id, read-ahead would mostly fetch unneeded pages
+  size_t width = _compressLines ? 1 : sizeof(util::geo::Point<int16_t>);
+  adviseRandom(_mappedLineData, width * _numMappedLineData);
+  adviseRandom(_mappedLineBoxes,
+               sizeof(util::geo::Box<int32_t>) * _numMappedLines);
+
+  LOG(INFO) << "[GEOMCACHE] Mapped " << std::fixed << std::setprecision(2)
+            << getMappedBytes() / (1024.0 * 1024.0)
+            << " MB of line points and line boxes from " << fname;
+}
+
+// _____________________________________________________________________________
+void GeomCache::unmapSections() {
+  if (!_map) return;
+  munmap(_map, _mapLen);
+  _map = 0;
+  _mapLen = 0;
+  _mappedLineData = 0;
+  _mappedLineBoxes = 0;
+  _numMappedLineData = 0;
+  _numMappedLines = 0;
+}
+
+// _____________________________________________________________________________
+size_t GeomCache::getMappedBytes() const {
+  if (!_map) return 0;
+  size_t width = _compressLines ? 1 : sizeof(util::geo::Point<int16_t>);
+  return width * _numMappedLineData +
+         sizeof(util::geo::Box<int32_t>) * _numMappedLines;
+}
+
+// _____________________________________________________________________________
+size_t GeomCache::getMappedResidentBytes() const {
+  if (!_map) return 0;
+
+  size_t pageSize = sysconf(_SC_PAGE_SIZE);
+  size_t width = _compressLines ? 1 : sizeof(util::geo::Point<int16_t>);
+
+  size_t ret = 0;
+  std::vector<unsigned char> vec;
+  for (const auto &sec :
+       {std::make_pair(_mappedLineData, width * _numMappedLineData),
+        std::make_pair(_mappedLineBoxes,
+                       sizeof(util::geo::Box<int32_t>) * _numMappedLines)}) {
+    if (sec.second == 0) continue;
+    auto range = pageAlign(sec.first, sec.second);
+    vec.resize((range.second + pageSize - 1) / pageSize);
+    if (mincore(range.first, range.second, vec.data()) != 0) continue;
+    for (auto v : vec) ret += (v & 1) * pageSize;
+  }
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+void GeomCache::linePointsFromDisk(std::ifstream f, size_t num) {
+  auto start = TIME();
+
+  size_t width = _compressLines ? 1 : sizeof(util::geo::Point<int16_t>);
+  char *data = _compressLines ? reinterpret_cast<char *>(_lineBytes.data())
+                              : reinterpret_cast<char *>(_linePoints.data());
+
+  for (size_t i = 0; i < num; i += 1024 * 1024) {
+    size_t n = std::min<size_t>(1024 * 1024, num - i);
+    f.read(data + i * width, n * width);
+  }
+
+  bool failed = !f.good();
+
+  if (failed) {
+    LOG(ERROR) << "[GEOMCACHE] Could not read line points of "
+               << _backendUrl;
+  } else {
+    LOG(INFO) << "[GEOMCACHE] Read " << num << " line points in "
+              << TOOK(start) / 1000000000.0 << "s";
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(_linesM);
+    _linesFailed = failed;
+    _linesReady = true;
+  }
+  _linesCv.notify_all();
 }
 
 // _____________________________________________________________________________
 void GeomCache::serializeToDisk(const std::string &fname) const {
+  // readers only ever see complete files
+  std::string tmpFname = fname + ".tmp";
   std::ofstream f;
-  f.open(fname);
+  f.open(tmpFname);
 
   std::string h = _indexHash;
   h.insert(h.end(), 99 - h.size(), ' ');
@@ -1240,47 +2056,158 @@ void GeomCache::serializeToDisk(const std::string &fname) const {
   assert(h.size() == 99);
   f.write(h.c_str(), 100);
 
+  h = _buildId;
+  h.insert(h.end(), 99 - h.size(), ' ');
+  f.write(h.c_str(), 100);
+
   size_t num = _points.size();
   f.write(reinterpret_cast<const char *>(&num), sizeof(size_t));
+  alignWrite(&f);
   f.write(reinterpret_cast<const char *>(&_points[0]),
-          sizeof(util::geo::FPoint) * num);
+          sizeof(util::geo::Point<int32_t>) * num);
 
-  num = _linePoints.size();
+  num = getLineDataSize();
   f.write(reinterpret_cast<const char *>(&num), sizeof(size_t));
-  f.write(reinterpret_cast<const char *>(&_linePoints[0]),
-          sizeof(util::geo::Point<int16_t>) * num);
+  alignWrite(&f);
+  if (_compressLines) {
+    f.write(reinterpret_cast<const char *>(lineBytes()), num);
+  } else {
+    f.write(reinterpret_cast<const char *>(linePoints()),
+            sizeof(util::geo::Point<int16_t>) * num);
+  }
 
   num = _lines.size();
   f.write(reinterpret_cast<const char *>(&num), sizeof(size_t));
-  f.write(reinterpret_cast<const char *>(&_lines[0]), sizeof(size_t) * num);
+  alignWrite(&f);
+  f.write(reinterpret_cast<const char *>(&_lines[0]), sizeof(uint32_t) * num);
+  alignWrite(&f);
+  f.write(reinterpret_cast<const char *>(&_linesHi[0]), sizeof(uint8_t) * num);
 
-  num = _qidToId.size();
+  // no count, always the same number as lines
+  alignWrite(&f);
+  f.write(reinterpret_cast<const char *>(lineBoxes()),
+          sizeof(util::geo::Box<int32_t>) * num);
+
+  num = _qids.size();
   f.write(reinterpret_cast<const char *>(&num), sizeof(size_t));
-  f.write(reinterpret_cast<const char *>(&_qidToId[0]),
-          sizeof(IdMapping) * num);
+  alignWrite(&f);
+  f.write(reinterpret_cast<const char *>(&_qids[0]),
+          sizeof(QLEVER_ID_TYPE) * num);
+  alignWrite(&f);
+  f.write(reinterpret_cast<const char *>(&_ids[0]), sizeof(ID_TYPE) * num);
+
+  num = _lodLines.size();
+  f.write(reinterpret_cast<const char *>(&num), sizeof(size_t));
+  f.write(reinterpret_cast<const char *>(_lodLines.data()),
+          sizeof(ID_TYPE) * num);
+
+  for (size_t l = 0; l < NUM_LODS; l++) {
+    f.write(reinterpret_cast<const char *>(_lodOffsets[l].data()),
+            sizeof(uint32_t) * num);
+    f.write(reinterpret_cast<const char *>(_lodOffsetsHi[l].data()),
+            sizeof(uint8_t) * num);
+    size_t numLodPoints = _lodPoints[l].size();
+    f.write(reinterpret_cast<const char *>(&numLodPoints), sizeof(size_t));
+    f.write(reinterpret_cast<const char *>(_lodPoints[l].data()),
+            sizeof(util::geo::Point<int16_t>) * numLodPoints);
+  }
 
   f.close();
+
+  if (!f.good() || rename(tmpFname.c_str(), fname.c_str()) != 0) {
+    unlink(tmpFname.c_str());
+    throw std::runtime_error("Could not write cache file " + fname);
+  }
+}
+
+// _____________________________________________________________________________
+std::string GeomCache::getRemoteIndexHash() {
+  {
+    std::lock_guard<std::mutex> guard(_hashM);
+
+    if (_remoteHashValid &&
+        std::chrono::steady_clock::now() - _remoteHashTime <
+            std::chrono::seconds(_indexHashTtl)) {
+      return _remoteHash;
+    }
+
+    // don't wait for a running request
+    if (_hashFetching && _remoteHash.size()) return _remoteHash;
+  }
+
+  return fetchIndexHash();
+}
+
+// _____________________________________________________________________________
+std::string GeomCache::refreshIndexHash() { return fetchIndexHash(); }
+
+// _____________________________________________________________________________
+void GeomCache::invalidateIndexHash() {
+  std::lock_guard<std::mutex> guard(_hashM);
+  _remoteHashValid = false;
+}
+
+// _____________________________________________________________________________
+std::string GeomCache::fetchIndexHash() {
+  std::lock_guard<std::mutex> curlGuard(_hashCurlM);
+
+  {
+    std::lock_guard<std::mutex> guard(_hashM);
+    _hashFetching = true;
+  }
+
+  auto hash = requestIndexHash();
+
+  std::lock_guard<std::mutex> guard(_hashM);
+  _hashFetching = false;
+
+  // failures are not cached
+  if (hash.size()) {
+    _remoteHash = hash;
+    _remoteHashTime = std::chrono::steady_clock::now();
+    _remoteHashValid = true;
+  }
+
+  return hash;
+}
+
+// _____________________________________________________________________________
+std::string GeomCache::wrapIndexHash(const std::string &raw) const {
+  // caches with compressed line points are incompatible, and so are caches
+  // with a different geometry order, as the geometry ids differ
+  return INDEX_HASH_PREFIX + (_compressLines ? "z_" : "") +
+         (_spatialSort ? "s_" : "") + raw;
 }
 
 // _____________________________________________________________________________
 std::string GeomCache::requestIndexHash() {
+  // the raw get-index-id of the backend, wrapped like the response below
+  if (_dumpTsv.size()) {
+    return wrapIndexHash(_dumpIndexHash);
+  }
+
   CURLcode res;
   char errbuf[CURL_ERROR_SIZE];
   std::string response;
 
-  if (_curl) {
+  if (_hashCurl) {
     std::string url = _backendUrl + "/?cmd=get-index-id";
-    curl_easy_setopt(_curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, GeomCache::writeCbString);
-    curl_easy_setopt(_curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(_curl, CURLOPT_ERRORBUFFER, errbuf);
-    curl_easy_setopt(_curl, CURLOPT_SSL_VERIFYPEER, false);
-    curl_easy_setopt(_curl, CURLOPT_SSL_VERIFYHOST, false);
-    curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, 0);
+    curl_easy_setopt(_hashCurl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(_hashCurl, CURLOPT_WRITEFUNCTION,
+                     GeomCache::writeCbString);
+    curl_easy_setopt(_hashCurl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(_hashCurl, CURLOPT_ERRORBUFFER, errbuf);
+    curl_easy_setopt(_hashCurl, CURLOPT_SSL_VERIFYPEER, false);
+    curl_easy_setopt(_hashCurl, CURLOPT_SSL_VERIFYHOST, false);
+    curl_easy_setopt(_hashCurl, CURLOPT_HTTPHEADER, 0);
+    curl_easy_setopt(_hashCurl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(_hashCurl, CURLOPT_CONNECTTIMEOUT,
+                     INDEX_HASH_CONNECT_TIMEOUT);
+    curl_easy_setopt(_hashCurl, CURLOPT_TIMEOUT, INDEX_HASH_TIMEOUT);
 
     // accept any compression supported
-    curl_easy_setopt(_curl, CURLOPT_ACCEPT_ENCODING, "");
-    res = curl_easy_perform(_curl);
+    curl_easy_setopt(_hashCurl, CURLOPT_ACCEPT_ENCODING, "");
+    res = curl_easy_perform(_hashCurl);
 
     if (res != CURLE_OK) {
       size_t len = strlen(errbuf);
@@ -1294,7 +2221,7 @@ std::string GeomCache::requestIndexHash() {
     }
 
     long httpCode = 0;
-    curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &httpCode);
+    curl_easy_getinfo(_hashCurl, CURLINFO_RESPONSE_CODE, &httpCode);
 
     if (httpCode != 200) {
       LOG(WARN) << "QLever backend returned status code " << httpCode
@@ -1302,7 +2229,7 @@ std::string GeomCache::requestIndexHash() {
       return "";
     }
 
-    return INDEX_HASH_PREFIX + response;
+    return wrapIndexHash(response);
   } else {
     LOG(ERROR) << "[GEOMCACHE] Failed to perform curl request for index hash.";
     return "";
@@ -1314,7 +2241,7 @@ std::string GeomCache::load(const std::string &cacheDir) {
   std::lock_guard<std::mutex> guard(_m);
 
   if (_ready) {
-    auto indexHash = requestIndexHash();
+    auto indexHash = getRemoteIndexHash();
     if (_indexHash == indexHash) return _indexHash;
     LOG(INFO) << "Loaded index hash (" << _indexHash
               << ") and remote index hash (" << indexHash << ") dont match.";
@@ -1325,9 +2252,23 @@ std::string GeomCache::load(const std::string &cacheDir) {
     std::string backend = getBackendURL();
     util::replaceAll(backend, "/", "_");
     std::string cacheFile = cacheDir + "/" + backend;
-    auto indexHash = requestIndexHash();
-    if (access(cacheFile.c_str(), F_OK) != -1 &&
-        indexHash == indexHashFromDisk(cacheFile)) {
+    auto indexHash = refreshIndexHash();
+
+    auto upToDate = [&]() {
+      return access(cacheFile.c_str(), F_OK) != -1 &&
+             indexHash == indexHashFromDisk(cacheFile);
+    };
+
+    // a single process builds a cache file, the others wait for the lock
+    // and then read the finished file
+    std::unique_ptr<FileLock> lock;
+    bool fromFile = upToDate();
+    if (!fromFile) {
+      lock.reset(new FileLock(cacheFile + ".lock"));
+      fromFile = upToDate();
+    }
+
+    if (fromFile) {
       LOG(INFO) << "Reading from cache file " << cacheFile << "...";
       fromDisk(cacheFile);
       LOG(INFO) << "done ...";
@@ -1337,19 +2278,35 @@ std::string GeomCache::load(const std::string &cacheDir) {
         ss << "No write access to cache dir " << cacheDir;
         throw std::runtime_error(ss.str());
       }
-      _indexHash = requestIndexHash();
+      _indexHash = indexHash;
+      _buildId = newBuildId();
       LOG(INFO) << "Index hash is '" << _indexHash << "'";
+      _buildFile = cacheFile + ".build";
       request();
       requestIds();
+      if (_spatialSort) sortSpatially();
+      buildLods();
+      accountMemory();
+      logIndexMemory();
       LOG(INFO) << "Serializing to cache file " << cacheFile << "...";
       serializeToDisk(cacheFile);
+      removeBuildFiles();
       LOG(INFO) << "done ...";
+
+      // serve the large sections from the file we just wrote
+      if (_mapSections) fromDisk(cacheFile);
     }
   } else {
-    _indexHash = requestIndexHash();
+    _buildFile.clear();
+    _indexHash = refreshIndexHash();
+    _buildId = newBuildId();
     LOG(INFO) << "Index hash is '" << _indexHash << "'";
     request();
     requestIds();
+    if (_spatialSort) sortSpatially();
+    buildLods();
+    accountMemory();
+    logIndexMemory();
   }
 
   _ready = true;
@@ -9,37 +9,60 @@
 
 #include <atomic>
 #include <fstream>
+#include <list>
 #include <map>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <chrono>
+#include <condition_variable>
+#include <thread>
 
+#include "qlever-petrimaps/LineCache.h"
 #include "qlever-petrimaps/Misc.h"
+#include "qlever-petrimaps/Wkt.h"
 #include "util/geo/Geo.h"
 
 namespace petrimaps {
 
 class GeomCache {
  public:
-  GeomCache() : _backendUrl(""), _curl(0) {}
-  explicit GeomCache(const std::string& backendUrl)
-      : _backendUrl(backendUrl), _curl(curl_easy_init()) {}
-
-  GeomCache& operator=(GeomCache&& o) {
-    _backendUrl = o._backendUrl;
-    _curl = curl_easy_init();
-    _lines = std::move(o._lines);
-    _linePoints = std::move(o._linePoints);
-    _points = std::move(o._points);
-    _dangling = o._dangling;
-    _state = o._state;
-    return *this;
-  };
+  GeomCache()
+      : _backendUrl(""),
+        _curl(0),
+        _hashCurl(0),
+        _indexHashTtl(0),
+        _spatialSort(false),
+        _compressLines(false),
+        _mapSections(false),
+        _lineCache(0, 0, ""),
+        _mem(0, "") {}
+  GeomCache(const std::string& backendUrl, MemoryBudget* budget,
+            bool spatialSort, bool compressLines, int indexHashTtl,
+            bool mapSections)
+      : _backendUrl(backendUrl),
+        _curl(curl_easy_init()),
+        _hashCurl(curl_easy_init()),
+        _indexHashTtl(indexHashTtl),
+        _spatialSort(spatialSort),
+        _compressLines(compressLines),
+        _mapSections(mapSections),
+        _lineCache(budget ? budget->getMax() * LINE_CACHE_FRACTION : 0, budget,
+                   "line cache " + backendUrl),
+        _mem(budget, "geometry cache " + backendUrl) {}
+
+  // caches are shared between sessions by pointer, they own curl handles
+  // and mappings and are never copied or moved
+  GeomCache(const GeomCache&) = delete;
+  GeomCache& operator=(const GeomCache&) = delete;
 
   ~GeomCache() {
+    joinLinesLoader();
+    unmapSections();
     if (_curl) curl_easy_cleanup(_curl);
+    if (_hashCurl) curl_easy_cleanup(_hashCurl);
   }
 
   bool ready() const {
@@ -51,6 +74,23 @@ class GeomCache {
 
   std::string load(const std::string& cacheFile);
 
+  // read the fill query results from local dumps instead of the backend,
+  // tsvFile as returned for text/tab-separated-values, idsFile as returned
+  // for application/octet-stream. The cache is built for indexHash.
+  void setDump(const std::string& tsvFile, const std::string& idsFile,
+               const std::string& indexHash) {
+    _dumpTsv = tsvFile;
+    _dumpIds = idsFile;
+    _dumpIndexHash = indexHash;
+  }
+
+  // take the reservations of the next load() from the bytes reserved by
+  // acc first, see MemoryAccount::prepay()
+  void prepayMemory(MemoryAccount* acc) { _mem.prepay(acc); }
+  void releasePrepaid() { _mem.releaseCredit(); }
+
+  size_t getMemoryUsage() const { return _mem.getUsed(); }
+
   void request();
   size_t requestSize();
   void requestPart(size_t offset);
@@ -66,28 +106,136 @@ class GeomCache {
       const std::vector<IdMapping>& id) const;
 
   const std::string& getBackendURL() const { return _backendUrl; }
+  const std::string& getIndexHash() const { return _indexHash; }
+
+  // random id of the build this cache was loaded from, geometry ids are
+  // only valid for the build they were taken from
+  const std::string& getBuildId() const { return _buildId; }
+
+  // whether the geometry ids follow a Hilbert curve, see sortSpatially()
+  bool isSpatiallySorted() const { return _spatialSort; }
+
+  // index hash of the backend, only fetched if the cached value is older
+  // than the index hash TTL. While another thread fetches it, the last
+  // fetched value is returned.
+  std::string getRemoteIndexHash();
 
-  const std::vector<util::geo::FPoint>& getPoints() const { return _points; }
+  // fetch the index hash of the backend and update the cached value
+  std::string refreshIndexHash();
 
-  const std::vector<util::geo::Point<int16_t>>& getLinePoints() const {
-    return _linePoints;
+  // the next getRemoteIndexHash() will fetch the index hash
+  void invalidateIndexHash();
+
+  const std::vector<util::geo::Point<int32_t>>& getPoints() const {
+    return _points;
   }
 
-  const std::vector<size_t>& getLines() const { return _lines; }
+  util::geo::FPoint getPoint(size_t id) const { return fromFixed(_points[id]); }
 
   util::geo::FBox getPointBBox(size_t id) const {
-    return util::geo::getBoundingBox(_points[id]);
+    return util::geo::getBoundingBox(getPoint(id));
+  }
+  util::geo::DBox getLineBBox(size_t id) const {
+    const auto& b = lineBoxes()[id];
+    return util::geo::DBox({b.getLowerLeft().getX() / 10.0,
+                            b.getLowerLeft().getY() / 10.0},
+                           {b.getUpperRight().getX() / 10.0,
+                            b.getUpperRight().getY() / 10.0});
+  }
+
+  // decoded geometry of line id, served from the line cache if possible
+  LineGeomPtr getLineGeom(size_t id) const;
+
+  // geometry of line id, simplified by at most resolution res if a
+  // precomputed simplification is available, served from the line cache
+  // (per level of detail) if possible
+  LineGeomPtr getLineGeom(size_t id, double res) const;
+
+  // decode the points of line id, simplified like getLineGeom(id, res), and
+  // append them to out, without going through the line cache
+  void decodeLine(size_t id, double res, util::geo::DLine* out) const;
+
+  // decode the points of line id and append them to out
+  template <typename T>
+  void decodeLine(size_t id, std::vector<util::geo::Point<T>>* out) const {
+    waitForLines();
+    if (_compressLines) {
+      decodeVarintLinePoints(lineBytes() + getLine(id), out);
+    } else {
+      decodeLinePoints(linePoints() + getLine(id),
+                       linePoints() + getLineEnd(id), out);
+    }
   }
-  util::geo::DBox getLineBBox(size_t id) const;
+
+  bool isArea(size_t id) const {
+    waitForLines();
+    if (_compressLines) return isVarintArea(lineBytes() + getLine(id));
+    // areas end in a major coord, which is not possible for other types
+    return isMCoord(linePoints()[getLineEnd(id) - 1].getX());
+  }
+
+  const LineCache& getLineCache() const { return _lineCache; }
+
+  // evict at least bytes from the line cache if possible, returns the
+  // number of bytes freed
+  size_t shrinkLineCache(size_t bytes) const {
+    return _lineCache.shrink(bytes);
+  }
+
+  // After fromDisk(), the cache is ready before the line points are read,
+  // everything but the line points themselves (points, qlever ids, line
+  // offsets and boxes, simplifications) is usable immediately. Block until
+  // the line points are available, throws if they could not be read. Call
+  // this before decoding lines in parallel regions, where it must not throw.
+  void waitForLines() const {
+    if (!_linesReady) {
+      std::unique_lock<std::mutex> lock(_linesM);
+      _linesCv.wait(lock, [this] { return _linesReady.load(); });
+    }
+
+    if (_linesFailed) {
+      throw std::runtime_error("Could not read line points of " +
+                               _backendUrl);
+    }
+  }
+
+  bool linesReady() const { return _linesReady && !_linesFailed; }
+
+  // whether the background read of the line points failed, the cache has to
+  // be replaced by a fresh one
+  bool linesFailed() const { return _linesFailed; }
+
+  // With mapSections, the line points and line boxes of cache files are not
+  // read into memory but mapped, the page cache holds the working set. As
+  // the kernel reclaims it on demand (and it may be shared with other
+  // processes), it is not reserved against the memory budget.
+
+  // bytes of the mapped sections, and how many of them are resident
+  size_t getMappedBytes() const;
+  size_t getMappedResidentBytes() const;
+
+  // result columns of query as reported by the backend, cached per
+  // normalized query for the current index, see MAX_CACHED_COLUMNS
+  bool getColumns(const std::string& query,
+                  std::vector<std::string>* cols) const;
+  void setColumns(const std::string& query,
+                  const std::vector<std::string>& cols) const;
 
   void serializeToDisk(const std::string& fname) const;
 
   void fromDisk(const std::string& fname);
 
-  size_t getLine(ID_TYPE id) const { return _lines[id]; }
+  size_t getLine(ID_TYPE id) const {
+    return (static_cast<size_t>(_linesHi[id]) << 32) | _lines[id];
+  }
 
   size_t getLineEnd(ID_TYPE id) const {
-    return id + 1 < _lines.size() ? _lines[id + 1] : _linePoints.size();
+    return id + 1 < _lines.size() ? getLine(id + 1) : getLineDataSize();
+  }
+
+  size_t getLineDataSize() const {
+    if (_map) return _numMappedLineData;
+    return _compressLines ? _lineBytes.size() : _linePoints.size();
   }
 
   double getLoadStatusPercent(bool total);
@@ -100,6 +248,69 @@ class GeomCache {
   std::string _backendUrl;
   CURL* _curl;
 
+  // separate handle for index hash requests, which may happen during a load
+  CURL* _hashCurl;
+
+  // seconds a fetched index hash is considered current
+  int _indexHashTtl;
+
+  // guards the cached value below, never held during a request
+  std::mutex _hashM;
+  std::string _remoteHash;
+  std::chrono::time_point<std::chrono::steady_clock> _remoteHashTime;
+  bool _remoteHashValid = false;
+  bool _hashFetching = false;
+
+  // one request on _hashCurl at a time
+  std::mutex _hashCurlM;
+
+  // local dumps of the fill query results, see setDump()
+  std::string _dumpTsv;
+  std::string _dumpIds;
+  std::string _dumpIndexHash;
+
+  // reorder geometries along a Hilbert curve after building
+  bool _spatialSort;
+
+  // store line points as zig-zag varint deltas
+  bool _compressLines;
+
+  // map the large sections of cache files instead of reading them
+  bool _mapSections;
+
+  // the mapped cache file, and its line point and line box sections
+  void* _map = 0;
+  size_t _mapLen = 0;
+  const char* _mappedLineData = 0;
+  const char* _mappedLineBoxes = 0;
+  size_t _numMappedLineData = 0;
+  size_t _numMappedLines = 0;
+
+  void mapSections(const std::string& fname, size_t posLineData,
+                   size_t posLineBoxes);
+  void unmapSections();
+
+  const util::geo::Point<int16_t>* linePoints() const {
+    if (_map) {
+      return reinterpret_cast<const util::geo::Point<int16_t>*>(
+          _mappedLineData);
+    }
+    return _linePoints.data();
+  }
+
+  const uint8_t* lineBytes() const {
+    if (_map) return reinterpret_cast<const uint8_t*>(_mappedLineData);
+    return _lineBytes.data();
+  }
+
+  const util::geo::Box<int32_t>* lineBoxes() const {
+    if (_map) {
+      return reinterpret_cast<const util::geo::Box<int32_t>*>(
+          _mappedLineBoxes);
+    }
+    return _lineBoxes.data();
+  }
+
   uint8_t _curByte;
   ID _curId;
   QLEVER_ID_TYPE _maxQid;
@@ -124,9 +335,22 @@ class GeomCache {
   std::string getCountQuery(const std::string& backendUrl) const;
 
   std::string requestIndexHash();
+  std::string wrapIndexHash(const std::string& raw) const;
+  std::string fetchIndexHash();
 
   std::string queryUrl(std::string query, size_t offset, size_t limit) const;
 
+  void readDump(const std::string& fname,
+                void (GeomCache::*parseFn)(const char*, size_t));
+
+  void openBuildFile(std::fstream* f, const std::string& name, size_t bytes);
+
+  // checkpoints of the geometry request after each completed OFFSET window,
+  // an interrupted build of the same index resumes from the last one
+  void writeCheckpoint();
+  bool readCheckpoint();
+  void removeBuildFiles();
+
   static bool pointValid(const util::geo::DPoint& p);
 
   static util::geo::DLine createLineString(const std::string& a, size_t p);
@@ -136,20 +360,72 @@ class GeomCache {
 	void addMultiLineString(const util::geo::MultiLine<double>& ml, size_t* i);
 	void addLineString(const util::geo::Line<double>& l, size_t* i);
   void addMultiPolygon(const util::geo::MultiPolygon<double>& mp, size_t* i);
+  void addLine(const util::geo::DLine& l, bool isArea, size_t* i);
+
+  // Add the geometry of type in _dangling by the coordinates parsed with
+  // parseWktCoords(), false if it has to go through the generic WKT parser.
+  bool addWkt(util::geo::WKTType type, size_t* i);
 
   void insertLine(const util::geo::DLine& l, bool isArea);
 
+  // the precomputed simplification of line lid for resolution res, as its
+  // level and its index into _lodLines, false if there is none
+  bool getLod(size_t lid, double res, size_t* level, size_t* i) const;
+  size_t getLodOffset(size_t level, size_t i) const {
+    return (static_cast<size_t>(_lodOffsetsHi[level][i]) << 32) |
+           _lodOffsets[level][i];
+  }
+
+  // key of line lid in the line cache, simplified with LOD level level,
+  // or not simplified if level is NUM_LODS
+  static size_t lineCacheKey(size_t lid, size_t level) {
+    return lid * (NUM_LODS + 1) + level;
+  }
+  void decodeLod(size_t level, size_t i, util::geo::DLine* out) const;
+
 	static std::vector<size_t> getGeomStarts(const std::string &str, size_t a);
 
   std::string indexHashFromDisk(const std::string& fname);
 
+  void logIndexMemory() const;
+
+  // reserve exactly the memory of the index vectors
+  void accountMemory();
+
+  void sortSpatially();
+  void buildLods();
+
   static util::geo::DPoint projD(const util::geo::DPoint& p) {
     return util::geo::latLngToWebMerc<double>(p);
   }
 
-  std::vector<util::geo::FPoint> _points;
+  // fixed point, see toFixed()
+  std::vector<util::geo::Point<int32_t>> _points;
   std::vector<util::geo::Point<int16_t>> _linePoints;
-  std::vector<size_t> _lines;
+
+  // line points in the compressed encoding, only used if _compressLines
+  std::vector<uint8_t> _lineBytes;
+
+  // 40 bit offsets of the lines into _linePoints (or _lineBytes), split into
+  // the lower 32 and the upper 8 bits
+  std::vector<uint32_t> _lines;
+  std::vector<uint8_t> _linesHi;
+
+  // per-line bounding boxes in fixed point (1 unit = 0.1 mercator units)
+  std::vector<util::geo::Box<int32_t>> _lineBoxes;
+
+  // sorted ids of the lines with precomputed simplifications, and per
+  // level of detail their 40 bit offsets into the simplified line points,
+  // split like _lines
+  std::vector<ID_TYPE> _lodLines;
+  std::vector<uint32_t> _lodOffsets[NUM_LODS];
+  std::vector<uint8_t> _lodOffsetsHi[NUM_LODS];
+  std::vector<util::geo::Point<int16_t>> _lodPoints[NUM_LODS];
+
+  mutable LineCache _lineCache;
+
+  // memory reserved for the index vectors
+  MemoryAccount _mem;
 
   size_t _pointsFSize;
   size_t _linePointsFSize;
@@ -159,28 +435,88 @@ class GeomCache {
   size_t _lastBytesReceived;
   std::chrono::time_point<std::chrono::high_resolution_clock> _lastReceivedTime;
 
+  // prefix of the named build files and the checkpoint of an ongoing
+  // build, empty for anonymous temporary files without checkpoints
+  std::string _buildFile;
+
   std::fstream _pointsF;
   std::fstream _linePointsF;
   std::fstream _linesF;
   std::fstream _qidToIdF;
+  std::fstream _lineBoxesF;
+
+  std::vector<util::geo::Point<int16_t>> _lineBuf;
+  std::vector<uint8_t> _varintBuf;
 
   size_t _geometryDuplicates = 0;
 
+  // Direct-mapped table of the single-part geometries of the current build
+  // by the 128 bit hash of their WKT, see DEDUP_TABLE_BITS. A repeated WKT
+  // anywhere in the stream re-uses the geometry id if its entry was not
+  // overwritten in the meantime. The table is not part of the checkpoint,
+  // a resumed build starts with an empty one and stores geometries repeated
+  // across the checkpoint again (under a new build id, see getBuildId()).
+  struct DedupEntry {
+    uint64_t h1;
+    uint64_t h2;
+    ID_TYPE id;
+  };
+  std::vector<DedupEntry> _dedup;
+  size_t _dedupHits = 0;
+
+  // rows that re-used the geometry of the row directly before them
+  size_t _adjacentHits = 0;
+
+  void reuseGeom(ID_TYPE id);
+
+  // buffers of addWkt(), and the number of geometries it left to the
+  // generic WKT parser
+  WktCoords _wkt;
+  util::geo::DLine _wktLine;
+  size_t _wktFallbacks = 0;
+
   size_t _lastQid = -1;
 
   IdMapping _lastQidToId;
 
+  // only used during the build, see _qids and _ids
   std::vector<IdMapping> _qidToId;
 
+  // mapping of qlever ids to geometry ids, sorted by qlever id
+  std::vector<QLEVER_ID_TYPE> _qids;
+  std::vector<ID_TYPE> _ids;
+
   std::string _dangling, _prev, _raw;
   ParseState _state;
 
   std::exception_ptr _exceptionPtr;
 
   mutable std::mutex _m;
+
+  // background read of the line points, see waitForLines()
+  std::thread _linesLoader;
+  std::atomic<bool> _linesReady{true};
+  std::atomic<bool> _linesFailed{false};
+  mutable std::mutex _linesM;
+  mutable std::condition_variable _linesCv;
+
+  void linePointsFromDisk(std::ifstream f, size_t num);
+  void joinLinesLoader() {
+    if (_linesLoader.joinable()) _linesLoader.join();
+  }
   bool _ready = false;
 
+  // cached result columns by the 128 bit hash of the normalized query, in
+  // least recently used order
+  typedef std::pair<uint64_t, uint64_t> ColumnsKey;
+  typedef std::list<std::pair<ColumnsKey, std::vector<std::string>>>
+      ColumnsLru;
+  mutable std::mutex _columnsM;
+  mutable ColumnsLru _columnsLru;
+  mutable std::map<ColumnsKey, ColumnsLru::iterator> _columns;
+
   std::string _indexHash;
+  std::string _buildId;
 };
 }  // namespace petrimaps
 
@@ -5,7 +5,9 @@
 #ifndef PETRIMAPS_GRID_H_
 #define PETRIMAPS_GRID_H_
 
+#include <istream>
 #include <map>
+#include <ostream>
 #include <unordered_set>
 #include <vector>
 #include "util/geo/Geo.h"
@@ -34,6 +36,9 @@ class Grid {
   }
 
   Grid<V, T>& operator=(Grid<V, T>&& o) {
+    if (this == &o) return *this;
+    clear();
+
     _width = o._width;
     _height = o._height;
     _cellWidth = o._cellWidth;
@@ -54,14 +59,7 @@ class Grid {
   // the empty grid
   Grid();
 
-  ~Grid() {
-    if (!_grid) return;
-    for (size_t i = 0; i < _xWidth * _yHeight; i++) {
-      if (!_grid[i]) continue;
-      delete _grid[i];
-    }
-    delete[] _grid;
-  }
+  ~Grid() { clear(); }
 
   // add object t to this grid
   void add(const util::geo::Box<T>& box, const V& val);
@@ -86,6 +84,14 @@ class Grid {
   util::geo::Box<T> getBox(size_t x, size_t y) const;
   util::geo::Box<T> getBBox() const { return _bb; }
 
+  // write the grid as its dimensions, the number of entries per cell and
+  // the concatenated cell entries, V must be trivially copyable
+  void serialize(std::ostream* f) const;
+  void deserialize(std::istream* f);
+
+  // total number of cell entries
+  size_t size() const;
+
  private:
   double _width;
   double _height;
@@ -99,6 +105,16 @@ class Grid {
   size_t _yHeight;
 
   std::vector<V>** _grid;
+
+  void clear() {
+    if (!_grid) return;
+    for (size_t i = 0; i < _xWidth * _yHeight; i++) {
+      if (!_grid[i]) continue;
+      delete _grid[i];
+    }
+    delete[] _grid;
+    _grid = 0;
+  }
 };
 
 #include "qlever-petrimaps/Grid.tpp"
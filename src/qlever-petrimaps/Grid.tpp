@@ -151,3 +151,69 @@ template <typename V, typename T>
 size_t Grid<V, T>::getYHeight() const {
   return _yHeight;
 }
+
+// _____________________________________________________________________________
+template <typename V, typename T>
+size_t Grid<V, T>::size() const {
+  size_t ret = 0;
+  for (size_t i = 0; i < _xWidth * _yHeight; i++) {
+    if (_grid[i]) ret += _grid[i]->size();
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+template <typename V, typename T>
+void Grid<V, T>::serialize(std::ostream* f) const {
+  f->write(reinterpret_cast<const char*>(&_width), sizeof(double));
+  f->write(reinterpret_cast<const char*>(&_height), sizeof(double));
+  f->write(reinterpret_cast<const char*>(&_cellWidth), sizeof(double));
+  f->write(reinterpret_cast<const char*>(&_cellHeight), sizeof(double));
+  f->write(reinterpret_cast<const char*>(&_bb), sizeof(util::geo::Box<T>));
+  f->write(reinterpret_cast<const char*>(&_xWidth), sizeof(size_t));
+  f->write(reinterpret_cast<const char*>(&_yHeight), sizeof(size_t));
+
+  std::vector<size_t> counts(_xWidth * _yHeight, 0);
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (_grid[i]) counts[i] = _grid[i]->size();
+  }
+  f->write(reinterpret_cast<const char*>(counts.data()),
+           sizeof(size_t) * counts.size());
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i]) continue;
+    f->write(reinterpret_cast<const char*>(_grid[i]->data()),
+             sizeof(V) * counts[i]);
+  }
+}
+
+// _____________________________________________________________________________
+template <typename V, typename T>
+void Grid<V, T>::deserialize(std::istream* f) {
+  *this = Grid<V, T>();
+
+  f->read(reinterpret_cast<char*>(&_width), sizeof(double));
+  f->read(reinterpret_cast<char*>(&_height), sizeof(double));
+  f->read(reinterpret_cast<char*>(&_cellWidth), sizeof(double));
+  f->read(reinterpret_cast<char*>(&_cellHeight), sizeof(double));
+  f->read(reinterpret_cast<char*>(&_bb), sizeof(util::geo::Box<T>));
+  f->read(reinterpret_cast<char*>(&_xWidth), sizeof(size_t));
+  f->read(reinterpret_cast<char*>(&_yHeight), sizeof(size_t));
+
+  if (!*f) throw GridException("Could not read grid");
+
+  std::vector<size_t> counts(_xWidth * _yHeight, 0);
+  f->read(reinterpret_cast<char*>(counts.data()),
+          sizeof(size_t) * counts.size());
+
+  _grid = new std::vector<V>*[_xWidth * _yHeight];
+  memset(_grid, 0, _xWidth * _yHeight * sizeof(std::vector<V>*));
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i]) continue;
+    _grid[i] = new std::vector<V>(counts[i]);
+    f->read(reinterpret_cast<char*>(_grid[i]->data()), sizeof(V) * counts[i]);
+  }
+
+  if (!*f) throw GridException("Could not read grid");
+}
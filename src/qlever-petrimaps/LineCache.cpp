@@ -0,0 +1,128 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#include "qlever-petrimaps/LineCache.h"
+
+using petrimaps::LineCache;
+using petrimaps::LineGeomPtr;
+
+// _____________________________________________________________________________
+LineCache::LineCache(size_t maxBytes, MemoryBudget* budget,
+                     const std::string& name)
+    : _maxBytesPerShard(maxBytes / NUM_SHARDS),
+      _shards(new Shard[NUM_SHARDS]),
+      _mem(budget, name),
+      _hits(0),
+      _misses(0) {}
+
+// _____________________________________________________________________________
+LineGeomPtr LineCache::get(size_t lid) const {
+  auto& s = shard(lid);
+  std::lock_guard<std::mutex> guard(s.m);
+
+  auto it = s.idx.find(lid);
+  if (it == s.idx.end()) {
+    _misses++;
+    return LineGeomPtr();
+  }
+
+  // move to front
+  s.lru.splice(s.lru.begin(), s.lru, it->second);
+  _hits++;
+  return it->second->second;
+}
+
+// _____________________________________________________________________________
+void LineCache::put(size_t lid, const LineGeomPtr& line) {
+  size_t bytes = lineBytes(*line);
+
+  // never cache geometries which would flush the complete shard
+  if (bytes > _maxBytesPerShard) return;
+
+  // the cache is the first thing to give up memory
+  try {
+    _mem.reserve(bytes);
+  } catch (const OutOfMemoryError& e) {
+    return;
+  }
+
+  auto& s = shard(lid);
+  std::lock_guard<std::mutex> guard(s.m);
+
+  // may have been inserted concurrently
+  if (s.idx.count(lid)) {
+    _mem.release(bytes);
+    return;
+  }
+
+  while (s.lru.size() && s.bytes + bytes > _maxBytesPerShard) evictLast(&s);
+
+  s.lru.push_front({lid, line});
+  s.idx[lid] = s.lru.begin();
+  s.bytes += bytes;
+}
+
+// _____________________________________________________________________________
+void LineCache::clear() {
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(_shards[i].m);
+    _shards[i].lru.clear();
+    _shards[i].idx.clear();
+    _shards[i].bytes = 0;
+  }
+
+  _mem.releaseAll();
+
+  _hits = 0;
+  _misses = 0;
+}
+
+// _____________________________________________________________________________
+size_t LineCache::shrink(size_t bytes) {
+  size_t freed = 0;
+  size_t perShard = bytes / NUM_SHARDS + 1;
+
+  // evict from all shards alike, which approximates a global LRU order
+  bool any = true;
+  while (freed < bytes && any) {
+    any = false;
+    for (size_t i = 0; i < NUM_SHARDS && freed < bytes; i++) {
+      std::lock_guard<std::mutex> guard(_shards[i].m);
+      size_t shardFreed = 0;
+      while (_shards[i].lru.size() && shardFreed < perShard) {
+        shardFreed += evictLast(&_shards[i]);
+      }
+      if (shardFreed) any = true;
+      freed += shardFreed;
+    }
+  }
+
+  return freed;
+}
+
+// _____________________________________________________________________________
+size_t LineCache::evictLast(Shard* s) {
+  size_t bytes = lineBytes(*s->lru.back().second);
+  s->bytes -= bytes;
+  _mem.release(bytes);
+  s->idx.erase(s->lru.back().first);
+  s->lru.pop_back();
+  return bytes;
+}
+
+// _____________________________________________________________________________
+size_t LineCache::getBytes() const {
+  size_t ret = 0;
+  for (size_t i = 0; i < NUM_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(_shards[i].m);
+    ret += _shards[i].bytes;
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+size_t LineCache::lineBytes(const util::geo::DLine& line) {
+  // rough estimate of the list, map and shared_ptr overhead
+  return sizeof(util::geo::DPoint) * line.capacity() + 128;
+}
@@ -0,0 +1,84 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#ifndef PETRIMAPS_LINECACHE_H_
+#define PETRIMAPS_LINECACHE_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "qlever-petrimaps/MemoryBudget.h"
+#include "util/geo/Geo.h"
+
+namespace petrimaps {
+
+typedef std::shared_ptr<const util::geo::DLine> LineGeomPtr;
+
+// Memory-bounded LRU cache of decoded line geometries, keyed by line id
+// (or any other id the caller derives from it, see
+// GeomCache::lineCacheKey()).
+// The cache is split into shards with separate locks, so that the parallel
+// render and click loops do not serialize on a single mutex. Cached
+// geometries are reserved against the memory budget, if one is given.
+class LineCache {
+ public:
+  LineCache(size_t maxBytes, MemoryBudget* budget, const std::string& name);
+
+  LineCache(const LineCache&) = delete;
+  LineCache& operator=(const LineCache&) = delete;
+
+  // return the cached geometry for line lid, or a nullptr if it is not cached
+  LineGeomPtr get(size_t lid) const;
+
+  // insert a geometry for line lid, evicting least recently used entries
+  // of the same shard if the shard is full. Nothing is cached if the
+  // memory budget is exhausted.
+  void put(size_t lid, const LineGeomPtr& line);
+
+  void clear();
+
+  // evict least recently used entries until at least bytes were freed or
+  // the cache is empty, returns the number of bytes freed
+  size_t shrink(size_t bytes);
+
+  size_t getHits() const { return _hits; }
+  size_t getMisses() const { return _misses; }
+  size_t getBytes() const;
+
+ private:
+  static const size_t NUM_SHARDS = 64;
+
+  typedef std::list<std::pair<size_t, LineGeomPtr>> LruList;
+
+  struct Shard {
+    std::mutex m;
+    LruList lru;
+    std::unordered_map<size_t, LruList::iterator> idx;
+    size_t bytes = 0;
+  };
+
+  static size_t lineBytes(const util::geo::DLine& line);
+
+  // evict the least recently used entry of s, returns its size
+  size_t evictLast(Shard* s);
+
+  Shard& shard(size_t lid) const { return _shards[lid % NUM_SHARDS]; }
+
+  size_t _maxBytesPerShard;
+  std::unique_ptr<Shard[]> _shards;
+
+  MemoryAccount _mem;
+
+  mutable std::atomic<size_t> _hits;
+  mutable std::atomic<size_t> _misses;
+};
+}  // namespace petrimaps
+
+#endif  // PETRIMAPS_LINECACHE_H_
@@ -0,0 +1,98 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#include "qlever-petrimaps/MemoryBudget.h"
+
+#include <algorithm>
+
+using petrimaps::MemoryAccount;
+using petrimaps::MemoryBudget;
+using petrimaps::OutOfMemoryError;
+
+// _____________________________________________________________________________
+void MemoryBudget::reserve(size_t bytes) {
+  size_t cur = _used.load();
+  do {
+    if (cur + bytes > _max) throw OutOfMemoryError(bytes, cur, _max);
+  } while (!_used.compare_exchange_weak(cur, cur + bytes));
+}
+
+// _____________________________________________________________________________
+void MemoryBudget::release(size_t bytes) { _used -= bytes; }
+
+// _____________________________________________________________________________
+std::vector<std::pair<std::string, size_t>> MemoryBudget::getAccounts() const {
+  std::lock_guard<std::mutex> guard(_m);
+  std::vector<std::pair<std::string, size_t>> ret;
+  for (auto acc : _accounts) ret.push_back({acc->getName(), acc->getUsed()});
+  return ret;
+}
+
+// _____________________________________________________________________________
+void MemoryBudget::addAccount(const MemoryAccount* acc) {
+  std::lock_guard<std::mutex> guard(_m);
+  _accounts.insert(acc);
+}
+
+// _____________________________________________________________________________
+void MemoryBudget::removeAccount(const MemoryAccount* acc) {
+  std::lock_guard<std::mutex> guard(_m);
+  _accounts.erase(acc);
+}
+
+// _____________________________________________________________________________
+MemoryAccount::MemoryAccount(MemoryBudget* budget, const std::string& name)
+    : _budget(budget), _name(name), _used(0), _credit(0) {
+  if (_budget) _budget->addAccount(this);
+}
+
+// _____________________________________________________________________________
+MemoryAccount::~MemoryAccount() {
+  releaseAll();
+  releaseCredit();
+  if (_budget) _budget->removeAccount(this);
+}
+
+// _____________________________________________________________________________
+void MemoryAccount::reserve(size_t bytes) {
+  size_t cur = _credit.load();
+  size_t fromCredit;
+  do {
+    fromCredit = std::min(cur, bytes);
+  } while (!_credit.compare_exchange_weak(cur, cur - fromCredit));
+
+  if (_budget && bytes > fromCredit) {
+    try {
+      _budget->reserve(bytes - fromCredit);
+    } catch (...) {
+      _credit += fromCredit;
+      throw;
+    }
+  }
+  _used += bytes;
+}
+
+// _____________________________________________________________________________
+void MemoryAccount::release(size_t bytes) {
+  if (bytes > _used) bytes = _used;
+  _used -= bytes;
+  if (_budget) _budget->release(bytes);
+}
+
+// _____________________________________________________________________________
+void MemoryAccount::releaseAll() {
+  size_t bytes = _used.exchange(0);
+  if (_budget) _budget->release(bytes);
+}
+
+// _____________________________________________________________________________
+void MemoryAccount::prepay(MemoryAccount* o) {
+  _credit += o->_used.exchange(0) + o->_credit.exchange(0);
+}
+
+// _____________________________________________________________________________
+void MemoryAccount::releaseCredit() {
+  size_t bytes = _credit.exchange(0);
+  if (_budget) _budget->release(bytes);
+}
@@ -0,0 +1,108 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#ifndef PETRIMAPS_MEMORYBUDGET_H_
+#define PETRIMAPS_MEMORYBUDGET_H_
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace petrimaps {
+
+class OutOfMemoryError : public std::exception {
+ public:
+  explicit OutOfMemoryError(size_t want, size_t have, size_t max)
+      : _want(want) {
+    std::stringstream ss;
+    ss << "Out of memory, ";
+    ss << "want: " << want << " bytes, already used: " << have << " of " << max
+       << " bytes";
+
+    _msg = ss.str();
+  }
+
+  const char* what() const noexcept { return _msg.c_str(); }
+
+  size_t getWant() const { return _want; }
+
+ private:
+  size_t _want;
+  std::string _msg;
+};
+
+class MemoryAccount;
+
+// Process-wide memory budget. Components reserve bytes before they allocate
+// larger structures, a reservation which would exceed the budget fails
+// with an OutOfMemoryError before anything was allocated.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(size_t maxBytes) : _max(maxBytes), _used(0) {}
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  void reserve(size_t bytes);
+  void release(size_t bytes);
+
+  size_t getMax() const { return _max; }
+  size_t getUsed() const { return _used; }
+
+  // name and reserved bytes of all live accounts
+  std::vector<std::pair<std::string, size_t>> getAccounts() const;
+
+ private:
+  friend class MemoryAccount;
+
+  void addAccount(const MemoryAccount* acc);
+  void removeAccount(const MemoryAccount* acc);
+
+  size_t _max;
+  std::atomic<size_t> _used;
+
+  mutable std::mutex _m;
+  std::set<const MemoryAccount*> _accounts;
+};
+
+// Bytes reserved by a single component (a session, a geometry cache, a
+// request) against a budget. Everything still reserved is given back on
+// destruction. Without a budget, reservations are only counted.
+class MemoryAccount {
+ public:
+  MemoryAccount(MemoryBudget* budget, const std::string& name);
+  ~MemoryAccount();
+
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  void reserve(size_t bytes);
+  void release(size_t bytes);
+  void releaseAll();
+
+  // take over the reservations of o as a credit: later reservations are
+  // taken from it before the budget is asked, and releaseAll() keeps it
+  void prepay(MemoryAccount* o);
+
+  // give back what is left of the credit
+  void releaseCredit();
+
+  size_t getUsed() const { return _used + _credit; }
+  const std::string& getName() const { return _name; }
+  MemoryBudget* getBudget() const { return _budget; }
+
+ private:
+  MemoryBudget* _budget;
+  std::string _name;
+  std::atomic<size_t> _used;
+  std::atomic<size_t> _credit;
+};
+}  // namespace petrimaps
+
+#endif  // PETRIMAPS_MEMORYBUDGET_H_
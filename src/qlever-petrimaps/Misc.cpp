@@ -255,8 +255,8 @@ size_t RequestReader::writeCbIds(void* contents, size_t size, size_t nmemb,
 
 // _____________________________________________________________________________
 void RequestReader::parseIds(const char* c, size_t size) {
-  // TODO: just a rough approximation
-  checkMem(size, _maxMemory);
+  // every 8 bytes become an IdMapping, plus the vector growth
+  _mem.reserve(size / 8 * sizeof(IdMapping) * 2);
 
   for (size_t i = 0; i < size; i++) {
     if (_raw.size() < 10000) _raw.push_back(c[i]);
@@ -272,7 +272,7 @@ void RequestReader::parseIds(const char* c, size_t size) {
 // _____________________________________________________________________________
 void RequestReader::parse(const char* c, size_t size) {
   // TODO: just a rough approximation
-  checkMem(size, _maxMemory);
+  _mem.reserve(size);
 
   const char* start = c;
   while (c < start + size) {
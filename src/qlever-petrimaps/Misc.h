@@ -5,28 +5,70 @@
 #include <curl/curl.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "qlever-petrimaps/MemoryBudget.h"
 #include "util/Misc.h"
+#include "util/geo/Geo.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef PETRIMAPS_MISC_H_
 #define PETRIMAPS_MISC_H_
 
+// geometry ids are 32 bit by default, which limits the number of points and
+// lines to 2^31 each. Build with -DPETRIMAPS_WIDE_IDS=ON for 64 bit ids.
+#ifdef PETRIMAPS_WIDE_IDS
+#define ID_TYPE uint64_t
+#else
 #define ID_TYPE uint32_t
+#endif
 #define QLEVER_ID_TYPE size_t
 
 // half of the ID space for points, half for the rest
-const static ID_TYPE I_OFFSET = 2147483648;
+const static ID_TYPE I_OFFSET = static_cast<ID_TYPE>(1)
+                                << (sizeof(ID_TYPE) * 8 - 1);
 const static size_t MAXROWS = 18446744073709551615u;
 
+// line offsets into the line point array are stored with 40 bits
+const static size_t MAX_LINE_POINTS = 1099511627776u;
+
 // major coordinates will fit into 2^15, as coordinates go from
 // -200375083.427892 to +200375083.427892
 const static int16_t M_COORD_GRANULARITY = 12230;
 const static int16_t M_COORD_OFFSET = 16384;
 
+// Douglas-Peucker epsilons (in web mercator units) of the precomputed
+// simplifications of lines with at least LOD_MIN_POINTS points
+const static size_t NUM_LODS = 3;
+const static double LOD_EPS[NUM_LODS] = {10, 40, 160};
+const static size_t LOD_MIN_POINTS = 64;
+
+// sessions with at most this many point grid entries keep an inline copy
+// of their point coordinates in grid cell order
+const static size_t INLINE_POINTS_MAX = 50000000;
+
+// maximum number of cached result column lists of each GeomCache, the least
+// recently used ones are evicted beyond that. They are keyed by a hash of
+// the query, so each entry only takes a few hundred bytes.
+const static size_t MAX_CACHED_COLUMNS = 10000;
+
+// share of the memory budget the decoded line geometry cache of each
+// GeomCache may use at most
+const static double LINE_CACHE_FRACTION = 0.05;
+
+// number of entries (as a power of 2) of the table used to recognize
+// repeated geometries during a cache build
+const static size_t DEDUP_TABLE_BITS = 21;
+
 namespace petrimaps {
 
 enum ParseState { IN_HEADER, IN_ROW };
@@ -60,36 +102,352 @@ inline int16_t isMCoord(int16_t c) {
   return c < -M_COORD_OFFSET || c >= M_COORD_OFFSET;
 }
 
-class OutOfMemoryError : public std::exception {
- public:
-  explicit OutOfMemoryError(size_t want, size_t have, size_t max) {
-    std::stringstream ss;
-    ss << "Out of memory, ";
-    ss << "want: " << want << " bytes, already used: " << have << " of " << max
-       << " bytes";
+// 64 bit FNV-1a hash of s, used to derive file names from cache keys
+inline uint64_t fnv1a(const std::string& s) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
 
-    _msg = ss.str();
+// 128 bit hash of s, as a 64 bit FNV-1a hash and a second, independent 64
+// bit multiply-rotate hash
+inline std::pair<uint64_t, uint64_t> hash128(const std::string& s) {
+  uint64_t h1 = 14695981039346656037ull;
+  uint64_t h2 = 0x9e3779b97f4a7c15ull ^ s.size();
+  for (unsigned char c : s) {
+    h1 ^= c;
+    h1 *= 1099511628211ull;
+    h2 = ((h2 ^ c) * 0xff51afd7ed558ccdull);
+    h2 = (h2 << 27) | (h2 >> 37);
   }
 
-  const char* what() const noexcept { return _msg.c_str(); }
+  // final avalanche of the second half
+  h2 ^= h2 >> 33;
+  h2 *= 0xc4ceb9fe1a85ec53ull;
+  h2 ^= h2 >> 33;
+  return {h1, h2};
+}
 
- private:
-  std::string _msg;
-};
+// Hilbert curve index of cell (x, y) in a 2^16 x 2^16 grid
+inline uint32_t hilbertKey(uint32_t x, uint32_t y) {
+  const uint32_t n = 1 << 16;
+  uint32_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+
+    // rotate quadrant
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
 
-inline void checkMem(size_t want, size_t max) {
-  size_t currentSize = util::getCurrentRSS();
+// Hilbert curve index of a web mercator coordinate
+inline uint32_t hilbertKey(double x, double y) {
+  const double w = 20037508.3427892;
+  double cx = std::min(std::max((x + w) / (2 * w), 0.0), 1.0);
+  double cy = std::min(std::max((y + w) / (2 * w), 0.0), 1.0);
+  return hilbertKey(static_cast<uint32_t>(cx * 65535),
+                    static_cast<uint32_t>(cy * 65535));
+}
 
-  if (currentSize + want > max) {
-    throw OutOfMemoryError(want, currentSize, max);
+// Return a pointer to the first major coordinate in [s, e), or e if the
+// range only holds minor coordinates. A coordinate c is major iff
+// c + M_COORD_OFFSET overflows into the negative int16 range, which allows
+// us to check 4 points at once with SSE2.
+inline const util::geo::Point<int16_t>* findMCoord(
+    const util::geo::Point<int16_t>* s, const util::geo::Point<int16_t>* e) {
+  static_assert(sizeof(util::geo::Point<int16_t>) == 4,
+                "Unexpected size of int16 point");
+#ifdef __SSE2__
+  const __m128i off = _mm_set1_epi16(M_COORD_OFFSET);
+  // only the sign bits of the x coordinates are relevant
+  const int xMask = 0x2222;
+  while (s + 4 <= e) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    int m = _mm_movemask_epi8(_mm_add_epi16(v, off)) & xMask;
+    if (m) return s + __builtin_ctz(m) / 4;
+    s += 4;
   }
+#endif
+  while (s < e && !isMCoord(s->getX())) s++;
+  return s;
 }
 
+// Encode line l as runs of minor coordinates relative to major coordinates
+// and append it to out. Every line starts relative to major coordinate
+// (0, 0). Areas are closed and end in a major coordinate, which is not
+// possible for other types.
+inline void encodeLinePoints(const util::geo::DLine& l, bool isArea,
+                             std::vector<util::geo::Point<int16_t>>* out) {
+  int16_t mainX = 0;
+  int16_t mainY = 0;
+
+  size_t n = l.size() + (isArea && l.size() ? 1 : 0);
+
+  for (size_t i = 0; i < n; i++) {
+    const auto& p = i < l.size() ? l[i] : l.front();
+    int16_t mainXLoc = (p.getX() * 10.0) / M_COORD_GRANULARITY;
+    int16_t mainYLoc = (p.getY() * 10.0) / M_COORD_GRANULARITY;
+
+    if (mainXLoc != mainX || mainYLoc != mainY) {
+      mainX = mainXLoc;
+      mainY = mainYLoc;
+      out->push_back({mCoord(mainX), mCoord(mainY)});
+    }
+
+    int16_t minorXLoc = (p.getX() * 10.0) - mainXLoc * M_COORD_GRANULARITY;
+    int16_t minorYLoc = (p.getY() * 10.0) - mainYLoc * M_COORD_GRANULARITY;
+
+    out->push_back({minorXLoc, minorYLoc});
+  }
+
+  if (isArea) out->push_back({mCoord(0), mCoord(0)});
+}
+
+// Decode the encoded line points in [s, e) and append them to out. Points
+// are stored as runs of minor coordinates, each run preceded by the major
+// coordinate it is relative to.
+template <typename T>
+inline void decodeLinePoints(const util::geo::Point<int16_t>* s,
+                             const util::geo::Point<int16_t>* e,
+                             std::vector<util::geo::Point<T>>* out) {
+  double mainX = 0;
+  double mainY = 0;
+
+  out->reserve(out->size() + (e - s));
+
+  while (s < e) {
+    if (isMCoord(s->getX())) {
+      mainX = rmCoord(s->getX()) * static_cast<double>(M_COORD_GRANULARITY);
+      mainY = rmCoord(s->getY()) * static_cast<double>(M_COORD_GRANULARITY);
+      s++;
+      continue;
+    }
+
+    const auto* runEnd = findMCoord(s, e);
+
+    size_t off = out->size();
+    size_t n = runEnd - s;
+    out->resize(off + n);
+    auto* dst = out->data() + off;
+
+    // branch-free, can be vectorized by the compiler
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = util::geo::Point<T>((mainX + s[i].getX()) / 10.0,
+                                   (mainY + s[i].getY()) / 10.0);
+    }
+
+    s = runEnd;
+  }
+}
+
+// Compressed line encoding: a varint header (number of points << 1 | area
+// bit), followed by the fixed point coordinates of the first point and the
+// deltas to the previous point for all others, each as a zig-zag varint.
+inline void writeVarint(uint64_t v, std::vector<uint8_t>* out) {
+  while (v >= 0x80) {
+    out->push_back((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  out->push_back(v);
+}
+
+inline uint64_t readVarint(const uint8_t** s) {
+  uint64_t v = 0;
+  int shift = 0;
+  while (**s & 0x80) {
+    v |= static_cast<uint64_t>(**s & 0x7F) << shift;
+    shift += 7;
+    (*s)++;
+  }
+  v |= static_cast<uint64_t>(**s) << shift;
+  (*s)++;
+  return v;
+}
+
+inline uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ (v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// Encode line l in the compressed encoding and append it to out. Areas are
+// closed.
+inline void encodeVarintLinePoints(const util::geo::DLine& l, bool isArea,
+                                   std::vector<uint8_t>* out) {
+  size_t n = l.size() + (isArea && l.size() ? 1 : 0);
+
+  writeVarint((n << 1) | (isArea ? 1 : 0), out);
+
+  // same fixed point precision as the major/minor encoding
+  int64_t lastX = 0;
+  int64_t lastY = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    const auto& p = i < l.size() ? l[i] : l.front();
+    int64_t x = p.getX() * 10.0;
+    int64_t y = p.getY() * 10.0;
+    writeVarint(zigzag(x - lastX), out);
+    writeVarint(zigzag(y - lastY), out);
+    lastX = x;
+    lastY = y;
+  }
+}
+
+// Return true if the compressed line at s is an area
+inline bool isVarintArea(const uint8_t* s) { return readVarint(&s) & 1; }
+
+// Decode the compressed line at s and append its points to out
+template <typename T>
+inline void decodeVarintLinePoints(const uint8_t* s,
+                                   std::vector<util::geo::Point<T>>* out) {
+  size_t n = readVarint(&s) >> 1;
+
+  size_t off = out->size();
+  out->resize(off + n);
+  auto* dst = out->data() + off;
+
+  int64_t x = 0;
+  int64_t y = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    x += unzigzag(readVarint(&s));
+    y += unzigzag(readVarint(&s));
+    dst[i] = util::geo::Point<T>(x / 10.0, y / 10.0);
+  }
+}
+
+// Points are stored in fixed point with the same precision as line points.
+// The int32 limits are never used, which allows exclusive comparisons.
+inline int32_t clampFixed(double v) {
+  if (v > std::numeric_limits<int32_t>::max() - 1)
+    return std::numeric_limits<int32_t>::max() - 1;
+  if (v < std::numeric_limits<int32_t>::min() + 1)
+    return std::numeric_limits<int32_t>::min() + 1;
+  return v;
+}
+
+inline int32_t toFixed(double c) { return clampFixed(std::round(c * 10.0)); }
+
+template <typename T>
+inline util::geo::Point<int32_t> toFixed(const util::geo::Point<T>& p) {
+  return util::geo::Point<int32_t>(toFixed(p.getX()), toFixed(p.getY()));
+}
+
+inline util::geo::FPoint fromFixed(const util::geo::Point<int32_t>& p) {
+  return util::geo::FPoint(p.getX() / 10.0, p.getY() / 10.0);
+}
+
+// Inclusive fixed point bounds of a box
+struct FixedBox {
+  template <typename T>
+  explicit FixedBox(const util::geo::Box<T>& b)
+      : minX(clampFixed(std::ceil(b.getLowerLeft().getX() * 10.0))),
+        minY(clampFixed(std::ceil(b.getLowerLeft().getY() * 10.0))),
+        maxX(clampFixed(std::floor(b.getUpperRight().getX() * 10.0))),
+        maxY(clampFixed(std::floor(b.getUpperRight().getY() * 10.0))) {}
+
+  int32_t minX, minY, maxX, maxY;
+};
+
+// Block of fixed point coordinates for batched viewport culling and
+// projection. Coordinates are gathered into x and y together with an
+// arbitrary id, cull() then writes the positions of all points inside a box
+// to idx, and project() the pixel coordinates of those points to px and py.
+struct PointBatch {
+  static const size_t SIZE = 1024;
+
+  int32_t x[SIZE];
+  int32_t y[SIZE];
+  size_t ids[SIZE];
+  uint32_t idx[SIZE];
+  int px[SIZE];
+  int py[SIZE];
+  size_t n = 0;
+
+  bool full() const { return n == SIZE; }
+
+  void add(const util::geo::Point<int32_t>& p, size_t id) {
+    x[n] = p.getX();
+    y[n] = p.getY();
+    ids[n] = id;
+    n++;
+  }
+
+  // return the number of points inside box, their positions are in idx
+  size_t cull(const FixedBox& box) {
+    size_t k = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // bounds are never at the int32 limits, see clampFixed()
+    const __m128i minX = _mm_set1_epi32(box.minX - 1);
+    const __m128i minY = _mm_set1_epi32(box.minY - 1);
+    const __m128i maxX = _mm_set1_epi32(box.maxX + 1);
+    const __m128i maxY = _mm_set1_epi32(box.maxY + 1);
+    for (; i + 4 <= n; i += 4) {
+      __m128i vx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+      __m128i vy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+      __m128i in = _mm_and_si128(
+          _mm_and_si128(_mm_cmpgt_epi32(vx, minX), _mm_cmplt_epi32(vx, maxX)),
+          _mm_and_si128(_mm_cmpgt_epi32(vy, minY), _mm_cmplt_epi32(vy, maxY)));
+      int m = _mm_movemask_ps(_mm_castsi128_ps(in));
+      while (m) {
+        idx[k++] = i + __builtin_ctz(m);
+        m &= m - 1;
+      }
+    }
+#endif
+    // branch-free
+    for (; i < n; i++) {
+      idx[k] = i;
+      k += (x[i] >= box.minX) & (x[i] <= box.maxX) & (y[i] >= box.minY) &
+           (y[i] <= box.maxY);
+    }
+    return k;
+  }
+
+  // select all points without culling, return their number
+  size_t all() {
+    for (size_t i = 0; i < n; i++) idx[i] = i;
+    return n;
+  }
+
+  // project the first k points in idx to a w x h pixel image of box
+  template <typename T>
+  void project(size_t k, const util::geo::Box<T>& box, int w, int h) {
+    const double ox = box.getLowerLeft().getX() * 10.0;
+    const double oy = box.getLowerLeft().getY() * 10.0;
+    const double sx =
+        w / ((box.getUpperRight().getX() - box.getLowerLeft().getX()) * 10.0);
+    const double sy =
+        h / ((box.getUpperRight().getY() - box.getLowerLeft().getY()) * 10.0);
+
+    for (size_t j = 0; j < k; j++) {
+      px[j] = (x[idx[j]] - ox) * sx;
+      py[j] = h - (y[idx[j]] - oy) * sy;
+    }
+  }
+};
+
 struct RequestReader {
-  explicit RequestReader(const std::string& backendUrl, size_t maxMemory)
+  RequestReader(const std::string& backendUrl, MemoryBudget* budget,
+                const std::string& account)
       : _backendUrl(backendUrl),
         _curl(curl_easy_init()),
-        _maxMemory(maxMemory) {}
+        _mem(budget, account) {}
   ~RequestReader() {
     if (_curl) curl_easy_cleanup(_curl);
   }
@@ -127,7 +485,7 @@ struct RequestReader {
   ID _curId;
   size_t _received = 0;
   std::vector<IdMapping> _ids;
-  size_t _maxMemory;
+  MemoryAccount _mem;
   std::exception_ptr exceptionPtr;
 };
 
@@ -20,7 +20,8 @@ using util::LogLevel::WARN;
 void printHelp(int argc, char** argv) {
   UNUSED(argc);
   std::cout << "Usage: " << argv[0]
-            << " [-p <port>] [-m <maxmemory>] [-c <cachedir>] [--help] [-h]"
+            << " [-p <port>] [-m <maxmemory>] [-c <cachedir>] [-s] [-z] [-o]"
+               " [--help] [-h]"
             << "\n";
   std::cout
       << "\nAllowed arguments:\n    -p <port>    Port for server to listen to "
@@ -28,8 +29,16 @@ void printHelp(int argc, char** argv) {
       << "\n    -m <memory>  Max memory in GB (default: 90% of system RAM)"
       << "\n    -c <dir>     cache dir (default: none)"
       << "\n    -t <minutes> request cache lifetime (default: 360)"
+      << "\n    -i <seconds> index hash lifetime, 0 to check the backend on "
+         "every query (default: 60)"
       << "\n    -a <numobjects> threshold for auto layer selection (default: "
-         "1000)\n";
+         "1000)"
+      << "\n    -s           sort geometries of new caches along a Hilbert "
+         "curve"
+      << "\n    -z           store line geometries of new caches compressed"
+      << "\n    -o           map the line geometries of cache files instead of "
+         "loading\n                 them into memory (requires -c, implies "
+         "-s)\n";
 }
 
 // _____________________________________________________________________________
@@ -46,7 +55,11 @@ int main(int argc, char** argv) {
   // default port
   int port = 9090;
   int cacheLifetime = 6 * 60;
+  int indexHashTtl = 60;
   size_t autoThreshold = 1000;
+  bool spatialSort = false;
+  bool compressLines = false;
+  bool mapCaches = false;
   double maxMemoryGB =
       (sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) * 0.9) / 1000000000;
   std::string cacheDir;
@@ -80,12 +93,26 @@ int main(int argc, char** argv) {
         exit(1);
       }
       cacheLifetime = atof(argv[i]);
+    } else if (cur == "-i") {
+      if (++i >= argc) {
+        LOG(ERROR) << "Missing argument for index hash lifetime (-i).";
+        exit(1);
+      }
+      indexHashTtl = atoi(argv[i]);
     } else if (cur == "-a") {
       if (++i >= argc) {
         LOG(ERROR) << "Missing argument for auto threshold (-a).";
         exit(1);
       }
       autoThreshold = atoi(argv[i]);
+    } else if (cur == "-s") {
+      spatialSort = true;
+    } else if (cur == "-z") {
+      compressLines = true;
+    } else if (cur == "-o") {
+      // lines close in space are close in the mapped file
+      mapCaches = true;
+      spatialSort = true;
     }
   }
 
@@ -96,10 +123,15 @@ int main(int argc, char** argv) {
       throw std::runtime_error(ss.str());
     }
 
+    if (mapCaches && cacheDir.empty()) {
+      LOG(WARN) << "Without a cache dir (-c), -o has no effect.";
+    }
+
     LOG(INFO) << "Starting server...";
     LOG(INFO) << "Max memory is " << maxMemoryGB << " GB...";
     Server serv(maxMemoryGB * 1000000000, cacheDir, cacheLifetime,
-                autoThreshold);
+                autoThreshold, spatialSort, compressLines, indexHashTtl,
+                mapCaches);
 
     LOG(INFO) << "Listening on port " << port;
     util::http::HttpServer(port, &serv, std::thread::hardware_concurrency())
@@ -0,0 +1,215 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#include "qlever-petrimaps/Sparql.h"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <utility>
+
+using petrimaps::SparqlToken;
+
+namespace {
+
+// _____________________________________________________________________________
+bool isVarChar(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_' ||
+         static_cast<unsigned char>(c) >= 0x80;
+}
+
+// _____________________________________________________________________________
+bool isNameChar(char c) { return isVarChar(c) || c == '-' || c == ':'; }
+
+// _____________________________________________________________________________
+bool isWordStart(char c) { return isVarChar(c) || c == ':'; }
+
+// _____________________________________________________________________________
+bool isAlpha(const std::string& s) {
+  for (char c : s) {
+    if (!isalpha(static_cast<unsigned char>(c))) return false;
+  }
+  return true;
+}
+
+// _____________________________________________________________________________
+std::string tokenText(const std::string& q, const SparqlToken& t) {
+  std::string s = q.substr(t.pos, t.len);
+  if (t.type == petrimaps::VAR) s[0] = '?';
+  if (t.type == petrimaps::WORD && isAlpha(s)) {
+    std::transform(s.begin(), s.end(), s.begin(), ::toupper);
+  }
+  return s;
+}
+
+}  // namespace
+
+// _____________________________________________________________________________
+std::vector<SparqlToken> petrimaps::tokenizeSparql(const std::string& q) {
+  std::vector<SparqlToken> ret;
+
+  size_t i = 0;
+  while (i < q.size()) {
+    char c = q[i];
+
+    if (isspace(static_cast<unsigned char>(c))) {
+      i++;
+      continue;
+    }
+
+    if (c == '#') {
+      while (i < q.size() && q[i] != '\n') i++;
+      continue;
+    }
+
+    size_t start = i;
+
+    if (c == '"' || c == '\'') {
+      std::string delim(q.compare(i, 3, std::string(3, c)) == 0 ? 3 : 1, c);
+      i += delim.size();
+      while (i < q.size()) {
+        if (q[i] == '\\') {
+          i += 2;
+        } else if (q.compare(i, delim.size(), delim) == 0) {
+          i += delim.size();
+          break;
+        } else {
+          i++;
+        }
+      }
+      i = std::min(i, q.size());
+
+      // a language tag is part of the literal, and is kept as written
+      if (i + 1 < q.size() && q[i] == '@' &&
+          isalpha(static_cast<unsigned char>(q[i + 1]))) {
+        i++;
+        while (i < q.size() && (isalnum(static_cast<unsigned char>(q[i])) ||
+                                q[i] == '-')) {
+          i++;
+        }
+      }
+      ret.push_back({LITERAL, start, i - start});
+      continue;
+    }
+
+    if (c == '<') {
+      // an IRI if there is a closing > before anything an IRI cannot
+      // contain, otherwise a comparison
+      size_t e = i + 1;
+      while (e < q.size() && q[e] != '>' && q[e] != '<' && q[e] != '"' &&
+             q[e] != '{' && q[e] != '}' &&
+             !isspace(static_cast<unsigned char>(q[e]))) {
+        e++;
+      }
+      if (e < q.size() && q[e] == '>') {
+        i = e + 1;
+        ret.push_back({IRI, start, i - start});
+        continue;
+      }
+    }
+
+    if ((c == '?' || c == '$') && i + 1 < q.size() && isVarChar(q[i + 1])) {
+      i++;
+      while (i < q.size() && isVarChar(q[i])) i++;
+      ret.push_back({VAR, start, i - start});
+      continue;
+    }
+
+    if (isWordStart(c)) {
+      // dots only inside of names and numbers, a trailing dot ends a triple
+      while (i < q.size() &&
+             (isNameChar(q[i]) ||
+              (q[i] == '.' && i + 1 < q.size() && isNameChar(q[i + 1])))) {
+        i++;
+      }
+      ret.push_back({WORD, start, i - start});
+      continue;
+    }
+
+    i++;
+    ret.push_back({PUNCT, start, 1});
+  }
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+std::string petrimaps::normalizeSparql(const std::string& q) {
+  const auto& toks = tokenizeSparql(q);
+
+  // (prefix name, IRI) of the PREFIX declarations of the prologue
+  std::vector<std::pair<std::string, std::string>> prefixes;
+
+  size_t i = 0;
+  while (i + 2 < toks.size() && tokenText(q, toks[i]) == "PREFIX" &&
+         toks[i + 2].type == IRI) {
+    prefixes.push_back({tokenText(q, toks[i + 1]), tokenText(q, toks[i + 2])});
+    i += 3;
+  }
+
+  // if a prefix is declared twice with different IRIs, the order matters
+  auto sorted = prefixes;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  bool conflict = false;
+  for (size_t j = 1; j < sorted.size(); j++) {
+    if (sorted[j].first == sorted[j - 1].first) conflict = true;
+  }
+
+  if (!conflict) prefixes = sorted;
+
+  std::string ret;
+  for (const auto& p : prefixes) {
+    ret += "PREFIX " + p.first + " " + p.second + " ";
+  }
+
+  for (; i < toks.size(); i++) ret += tokenText(q, toks[i]) + " ";
+
+  if (ret.size()) ret.pop_back();
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+petrimaps::SparqlProjection petrimaps::findSparqlProjection(
+    const std::string& q) {
+  SparqlProjection ret{std::string::npos, ""};
+
+  const auto& toks = tokenizeSparql(q);
+
+  size_t i = 0;
+  while (i < toks.size() &&
+         !(toks[i].type == WORD && tokenText(q, toks[i]) == "SELECT")) {
+    i++;
+  }
+
+  for (size_t j = i + 1; j < toks.size(); j++) {
+    if (toks[j].type == PUNCT && q[toks[j].pos] == '{') {
+      ret.selectPos = toks[i].pos;
+      break;
+    }
+
+    if (toks[j].type == VAR) ret.lastVar = q.substr(toks[j].pos, toks[j].len);
+    if (toks[j].type == PUNCT && q[toks[j].pos] == '*') ret.lastVar = "*";
+  }
+
+  return ret;
+}
+
+// _____________________________________________________________________________
+bool petrimaps::isSparqlCacheable(const std::string& q) {
+  static const std::set<std::string> nonDet = {"RAND", "NOW", "UUID",
+                                               "STRUUID", "BNODE"};
+
+  const auto& toks = tokenizeSparql(q);
+
+  for (size_t i = 0; i + 1 < toks.size(); i++) {
+    if (toks[i].type != WORD || toks[i + 1].type != PUNCT) continue;
+    if (q[toks[i + 1].pos] != '(') continue;
+    if (nonDet.count(tokenText(q, toks[i]))) return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,51 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#ifndef PETRIMAPS_SPARQL_H_
+#define PETRIMAPS_SPARQL_H_
+
+#include <string>
+#include <vector>
+
+namespace petrimaps {
+
+enum SparqlTokenType { WORD, VAR, IRI, LITERAL, PUNCT };
+
+// A token of a SPARQL query, given by its position in the query string.
+// WORDs are keywords, function names, prefixed names and numbers, the
+// language tag of a LITERAL is part of it.
+struct SparqlToken {
+  SparqlTokenType type;
+  size_t pos;
+  size_t len;
+};
+
+// Split query into tokens, comments and whitespace are dropped. This is not
+// a validating parser, invalid queries yield some tokenization.
+std::vector<SparqlToken> tokenizeSparql(const std::string& query);
+
+// Normalized form of query for use as a cache key: comments are removed,
+// tokens are separated by single spaces, keywords are upper case, $ vars
+// are written as ? vars and the PREFIX declarations of the prologue are
+// sorted. Queries which only differ in these respects have the same
+// results and the same key.
+std::string normalizeSparql(const std::string& query);
+
+// The first SELECT clause of a query, given by the position of the SELECT
+// keyword and its last projected variable ("*" for SELECT *). The position
+// is npos if the query has no SELECT clause followed by a group.
+struct SparqlProjection {
+  size_t selectPos;
+  std::string lastVar;
+};
+
+SparqlProjection findSparqlProjection(const std::string& query);
+
+// Whether the results of query may be cached, which is not the case if it
+// uses a non-deterministic function like RAND() or NOW()
+bool isSparqlCacheable(const std::string& query);
+
+}  // namespace petrimaps
+
+#endif  // PETRIMAPS_SPARQL_H_
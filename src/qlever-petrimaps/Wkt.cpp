@@ -0,0 +1,250 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#include "qlever-petrimaps/Wkt.h"
+
+#include <strings.h>
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using petrimaps::WktCoords;
+using util::geo::WKTType;
+
+namespace {
+
+// powers of ten which are exactly representable as doubles
+const double POW10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// _____________________________________________________________________________
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Return a pointer to the first non-digit in [p, end), or end. Shifting
+// '0'..'9' by 0x50 maps them to the 10 smallest signed bytes, which allows
+// us to check 16 characters at once with SSE2. The digit runs of WKT
+// coordinates are usually shorter than that, so a run mostly ends within
+// the first load.
+inline const char* skipDigits(const char* p, const char* end) {
+#ifdef __SSE2__
+  const __m128i off = _mm_set1_epi8(0x50);
+  const __m128i lim = _mm_set1_epi8(-118);
+  while (p + 16 <= end) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    int m = _mm_movemask_epi8(_mm_cmplt_epi8(_mm_add_epi8(v, off), lim));
+    if (m != 0xFFFF) return p + __builtin_ctz(~m);
+    p += 16;
+  }
+#endif
+  while (p < end && isDigit(*p)) p++;
+  return p;
+}
+
+// _____________________________________________________________________________
+inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// _____________________________________________________________________________
+inline void skipSpace(const char** c, const char* end) {
+  while (*c < end && isSpace(**c)) (*c)++;
+}
+
+// _____________________________________________________________________________
+bool parsePoint(const char** c, const char* end, WktCoords* out) {
+  double x, y;
+
+  skipSpace(c, end);
+  if (!petrimaps::parseWktNumber(c, end, &x)) return false;
+  if (*c >= end || !isSpace(**c)) return false;
+  skipSpace(c, end);
+  if (!petrimaps::parseWktNumber(c, end, &y)) return false;
+  skipSpace(c, end);
+
+  // a third coordinate is not handled
+  if (*c >= end || (**c != ',' && **c != ')')) return false;
+
+  out->points.push_back({x, y});
+  return true;
+}
+
+// _____________________________________________________________________________
+bool parseList(const char** c, const char* end, size_t depth,
+               bool parenPoints, WktCoords* out) {
+  skipSpace(c, end);
+  if (*c >= end || **c != '(') return false;
+  (*c)++;
+
+  while (true) {
+    if (depth > 1) {
+      if (!parseList(c, end, depth - 1, parenPoints, out)) return false;
+    } else {
+      // the points of a MULTIPOINT may be parenthesized
+      skipSpace(c, end);
+      bool paren = parenPoints && *c < end && **c == '(';
+      if (paren) (*c)++;
+      if (!parsePoint(c, end, out)) return false;
+      if (paren) {
+        if (**c != ')') return false;
+        (*c)++;
+      }
+    }
+
+    skipSpace(c, end);
+    if (*c >= end) return false;
+    if (**c == ',') {
+      (*c)++;
+      continue;
+    }
+    if (**c == ')') {
+      (*c)++;
+      break;
+    }
+    return false;
+  }
+
+  if (depth == 1) out->ends.push_back(out->points.size());
+  return true;
+}
+
+}  // namespace
+
+// _____________________________________________________________________________
+bool petrimaps::parseWktNumber(const char** c, const char* end, double* out) {
+  const char* p = *c;
+
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+
+  // the first 19 significant digits, and the decimal exponent
+  uint64_t mant = 0;
+  int digits = 0;
+  int exp = 0;
+  bool any = false;
+
+  const char* run = skipDigits(p, end);
+  if (run > p) any = true;
+  for (; p < run; p++) {
+    if (digits < 19) {
+      mant = mant * 10 + (*p - '0');
+      if (mant) digits++;
+    } else {
+      exp++;
+    }
+  }
+
+  if (p < end && *p == '.') {
+    p++;
+    run = skipDigits(p, end);
+    if (run > p) any = true;
+    for (; p < run; p++) {
+      if (digits < 19) {
+        mant = mant * 10 + (*p - '0');
+        if (mant) digits++;
+        exp--;
+      }
+    }
+  }
+
+  if (!any) return false;
+
+  bool hasExp = false;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* e = p + 1;
+    bool expNeg = false;
+    if (e < end && (*e == '-' || *e == '+')) {
+      expNeg = *e == '-';
+      e++;
+    }
+    if (e >= end || !isDigit(*e)) return false;
+    int expVal = 0;
+    for (; e < end && isDigit(*e); e++) {
+      if (expVal < 10000) expVal = expVal * 10 + (*e - '0');
+    }
+    exp += expNeg ? -expVal : expVal;
+    hasExp = true;
+    p = e;
+  }
+
+  if (hasExp || exp < -22 || exp > 0) {
+    // rare in WKT, leave this to strtod()
+    *out = strtod(std::string(*c, p).c_str(), 0);
+  } else {
+    // mantissa divided by an exact power of ten, correctly rounded for up
+    // to 15 digits and within an ulp beyond, far below the fixed point
+    // precision of the cache
+    *out = static_cast<double>(mant) / POW10[-exp];
+    if (neg) *out = -*out;
+  }
+
+  *c = p;
+  return true;
+}
+
+// _____________________________________________________________________________
+bool petrimaps::parseWktCoords(const char* s, size_t len, WKTType type,
+                               WktCoords* out) {
+  const char* kw = 0;
+  size_t depth = 0;
+
+  switch (type) {
+    case WKTType::POINT:
+      kw = "POINT";
+      depth = 1;
+      break;
+    case WKTType::LINESTRING:
+      kw = "LINESTRING";
+      depth = 1;
+      break;
+    case WKTType::POLYGON:
+      kw = "POLYGON";
+      depth = 2;
+      break;
+    case WKTType::MULTIPOINT:
+      kw = "MULTIPOINT";
+      depth = 1;
+      break;
+    case WKTType::MULTILINESTRING:
+      kw = "MULTILINESTRING";
+      depth = 2;
+      break;
+    case WKTType::MULTIPOLYGON:
+      kw = "MULTIPOLYGON";
+      depth = 3;
+      break;
+    default:
+      return false;
+  }
+
+  const char* end = s + len;
+  const char* c = static_cast<const char*>(memchr(s, '(', len));
+  if (!c) return false;
+
+  // the keyword must directly precede the coordinates, which rules out
+  // Z, M and ZM geometries
+  const char* k = c;
+  while (k > s && isSpace(k[-1])) k--;
+  size_t kwLen = strlen(kw);
+  if (static_cast<size_t>(k - s) < kwLen) return false;
+  k -= kwLen;
+  if (strncasecmp(k, kw, kwLen) != 0) return false;
+  if (k > s && isalpha(static_cast<unsigned char>(k[-1]))) return false;
+
+  out->clear();
+  if (!parseList(&c, end, depth, type == WKTType::MULTIPOINT, out)) {
+    return false;
+  }
+
+  return type != WKTType::POINT || out->points.size() == 1;
+}
@@ -0,0 +1,43 @@
+// Copyright 2022, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
+
+#ifndef PETRIMAPS_WKT_H_
+#define PETRIMAPS_WKT_H_
+
+#include <string>
+#include <vector>
+
+#include "util/geo/Geo.h"
+
+namespace petrimaps {
+
+// The coordinates of a WKT geometry: all points in the order they appear,
+// and the end of each innermost coordinate list (the points of a
+// LINESTRING, the rings of a POLYGON, ...) in points.
+struct WktCoords {
+  std::vector<util::geo::DPoint> points;
+  std::vector<size_t> ends;
+
+  void clear() {
+    points.clear();
+    ends.clear();
+  }
+};
+
+// Parse the coordinates of the WKT geometry of the given type in
+// [s, s + len) into out, without projection. Text before the type keyword
+// (quotes, a CRS IRI) and after the geometry (a datatype) is skipped. Only
+// POINT, LINESTRING, POLYGON and their MULTI variants with 2D coordinates
+// are handled, false is returned for anything else (EMPTY geometries, Z
+// or M coordinates, malformed input).
+bool parseWktCoords(const char* s, size_t len, util::geo::WKTType type,
+                    WktCoords* out);
+
+// Parse the decimal number at *c, which is moved behind it. Without
+// exponent and with at most 19 significant digits, no strtod() is needed.
+bool parseWktNumber(const char** c, const char* end, double* out);
+
+}  // namespace petrimaps
+
+#endif  // PETRIMAPS_WKT_H_
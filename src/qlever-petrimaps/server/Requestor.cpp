@@ -3,12 +3,16 @@
 // Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
 
 #include <algorithm>
+#include <unistd.h>
+
 #include <cstring>
+#include <fstream>
 #include <iostream>
-#include <regex>
 #include <sstream>
+#include <tuple>
 
 #include "qlever-petrimaps/Misc.h"
+#include "qlever-petrimaps/Sparql.h"
 #include "qlever-petrimaps/server/Requestor.h"
 #include "util/Misc.h"
 #include "util/geo/Geo.h"
@@ -28,6 +32,32 @@ using util::LogLevel::INFO;
 using util::LogLevel::ERROR;
 using util::LogLevel::WARN;
 
+// rough estimates of the grid memory per object, including vector growth
+// and, for points, the cluster entries
+static const size_t POINT_GRID_OBJ_BYTES =
+    2 * sizeof(ID_TYPE) + sizeof(std::pair<ID_TYPE, std::pair<size_t, size_t>>);
+static const size_t LINE_GRID_OBJ_BYTES = 4 * sizeof(ID_TYPE);
+
+// _____________________________________________________________________________
+template <typename T>
+static void writeVec(std::ostream* f, const std::vector<T>& v) {
+  size_t n = v.size();
+  f->write(reinterpret_cast<const char*>(&n), sizeof(size_t));
+  f->write(reinterpret_cast<const char*>(v.data()), sizeof(T) * n);
+}
+
+// _____________________________________________________________________________
+template <typename T>
+static void readVec(std::istream* f, std::vector<T>* v,
+                    petrimaps::MemoryAccount* mem) {
+  size_t n = 0;
+  f->read(reinterpret_cast<char*>(&n), sizeof(size_t));
+  if (!*f) throw std::runtime_error("Could not read vector size");
+  if (mem) mem->reserve(sizeof(T) * n);
+  v->resize(n);
+  f->read(reinterpret_cast<char*>(v->data()), sizeof(T) * n);
+}
+
 // _____________________________________________________________________________
 void Requestor::request(const std::string& qry) {
   std::lock_guard<std::mutex> guard(_m);
@@ -37,6 +67,8 @@ void Requestor::request(const std::string& qry) {
     return;
   }
 
+  if (fromSpillFile()) return;
+
   if (!_cache->ready()) {
     throw std::runtime_error("Geom cache not ready");
   }
@@ -45,41 +77,14 @@ void Requestor::request(const std::string& qry) {
   _ready = false;
   _objects.clear();
   _clusterObjects.clear();
+  _pgridCoords.clear();
+  _pgridCoordOffs.clear();
+  _mem.releaseAll();
 
-  RequestReader reader(_cache->getBackendURL(), _maxMemory);
-  _query = qry;
-
-  LOG(INFO) << "[REQUESTOR] Requesting IDs for query " << qry;
-  reader.requestIds(prepQuery(qry));
-
-  LOG(INFO) << "[REQUESTOR] Done, have " << reader._ids.size()
-            << " ids in total.";
-
-  // join with geoms from GeomCache
-
-  // sort by qlever id
-  LOG(INFO) << "[REQUESTOR] Sorting results by qlever ID...";
-  std::sort(reader._ids.begin(), reader._ids.end());
-  LOG(INFO) << "[REQUESTOR] ... done";
-
-  LOG(INFO) << "[REQUESTOR] Retrieving geoms from cache...";
-
-  // (geom id, result row)
-  const auto& ret = _cache->getRelObjects(reader._ids);
-  _objects = ret.first;
-  _numObjects = ret.second;
-
-  LOG(INFO) << "[REQUESTOR] ... done, got "
-            << _objects.size() << " objects.";
-
-  LOG(INFO) << "[REQUESTOR] Retrieving points dynamically from query...";
-
-  // dynamic points present in query
-  _dynamicPoints = getDynamicPoints(reader._ids);
-  _numObjects += _dynamicPoints.size();
-
-  LOG(INFO) << "[REQUESTOR] ... done, got "
-            << _dynamicPoints.size() << " points.";
+  if (!resultFromDisk()) {
+    requestObjects(qry);
+    resultToDisk();
+  }
 
   LOG(INFO) << "[REQUESTOR] Calculating bounding box of result...";
 
@@ -101,7 +106,7 @@ void Requestor::request(const std::string& qry) {
       if (geomId < I_OFFSET) {
         auto pId = geomId;
         pointBoxes[t] =
-            util::geo::extendBox(_cache->getPoints()[pId], pointBoxes[t]);
+            util::geo::extendBox(_cache->getPoint(pId), pointBoxes[t]);
       } else if (geomId < std::numeric_limits<ID_TYPE>::max()) {
         auto lId = geomId - I_OFFSET;
 
@@ -173,9 +178,9 @@ void Requestor::request(const std::string& qry) {
   LOG(INFO) << "[REQUESTOR] (" << lxWidth << "x" << lyHeight
             << " cell line grid)";
 
-  checkMem(8 * (pxWidth * pyHeight), _maxMemory);
-  checkMem(8 * (lxWidth * lyHeight), _maxMemory);
-  checkMem(8 * (lxWidth * lyHeight), _maxMemory);
+  _mem.reserve(8 * (pxWidth * pyHeight));
+  _mem.reserve(8 * (lxWidth * lyHeight));
+  _mem.reserve(8 * (lxWidth * lyHeight));
 
   util::geo::FBox fLineBbox = {
       {lineBbox.getLowerLeft().getX(), lineBbox.getLowerLeft().getY()},
@@ -188,6 +193,10 @@ void Requestor::request(const std::string& qry) {
 
   std::exception_ptr ePtr;
 
+  // fail here if the line points of the cache could not be read, and not
+  // inside of the parallel sections
+  _cache->waitForLines();
+
 #pragma omp parallel sections
   {
 #pragma omp section
@@ -209,18 +218,18 @@ void Requestor::request(const std::string& qry) {
         if (clusterI > 0) {
           for (size_t m = 0; m < clusterI; m++) {
             const auto& p = _objects[i - m];
-            _pgrid.add(_cache->getPoints()[p.first], j);
+            _pgrid.add(_cache->getPoint(p.first), j);
             _clusterObjects.push_back({i - m, {m, clusterI}});
             j++;
           }
         } else {
-          _pgrid.add(_cache->getPoints()[geomId], i);
+          _pgrid.add(_cache->getPoint(geomId), i);
         }
 
-        // every 100000 objects, check memory...
+        // every 100000 objects, account for their grid entries
         if (i % 100000 == 0) {
           try {
-            checkMem(1, _maxMemory);
+            _mem.reserve(100000 * POINT_GRID_OBJ_BYTES);
           } catch (...) {
 #pragma omp critical
             { ePtr = std::current_exception(); }
@@ -253,10 +262,10 @@ void Requestor::request(const std::string& qry) {
           _pgrid.add(geom, i + _objects.size());
         }
 
-        // every 100000 objects, check memory...
+        // every 100000 objects, account for their grid entries
         if (i % 100000 == 0) {
           try {
-            checkMem(1, _maxMemory);
+            _mem.reserve(100000 * POINT_GRID_OBJ_BYTES);
           } catch (...) {
 #pragma omp critical
             { ePtr = std::current_exception(); }
@@ -281,10 +290,10 @@ void Requestor::request(const std::string& qry) {
         }
         i++;
 
-        // every 100000 objects, check memory...
+        // every 100000 objects, account for their grid entries
         if (i % 100000 == 0) {
           try {
-            checkMem(1, _maxMemory);
+            _mem.reserve(100000 * LINE_GRID_OBJ_BYTES);
           } catch (...) {
 #pragma omp critical
             { ePtr = std::current_exception(); }
@@ -297,38 +306,21 @@ void Requestor::request(const std::string& qry) {
 #pragma omp section
     {
       size_t i = 0;
+      size_t lpgridBytes = 0;
+      std::vector<util::geo::FPoint> linePoints;
       for (const auto& l : _objects) {
         if (l.first >= I_OFFSET &&
             l.first < std::numeric_limits<ID_TYPE>::max()) {
           auto geomId = l.first - I_OFFSET;
 
-          size_t start = _cache->getLine(geomId);
-          size_t end = _cache->getLineEnd(geomId);
-
-          double mainX = 0;
-          double mainY = 0;
-
-          size_t gi = 0;
+          linePoints.clear();
+          _cache->decodeLine(geomId, &linePoints);
 
           uint8_t lastX = 0;
           uint8_t lastY = 0;
 
-          for (size_t li = start; li < end; li++) {
-            const auto& cur = _cache->getLinePoints()[li];
-
-            if (isMCoord(cur.getX())) {
-              mainX = rmCoord(cur.getX());
-              mainY = rmCoord(cur.getY());
-              continue;
-            }
-
-            // skip bounding box at beginning
-            if (++gi < 3) continue;
-
-            // extract real geometry
-            util::geo::FPoint curP(
-                (mainX * M_COORD_GRANULARITY + cur.getX()) / 10.0,
-                (mainY * M_COORD_GRANULARITY + cur.getY()) / 10.0);
+          for (size_t gi = 0; gi < linePoints.size(); gi++) {
+            const auto& curP = linePoints[gi];
 
             size_t cellX = _lpgrid.getCellXFromX(curP.getX());
             size_t cellY = _lpgrid.getCellYFromY(curP.getY());
@@ -342,8 +334,9 @@ void Requestor::request(const std::string& qry) {
                  cellY * _lpgrid.getCellHeight()) /
                 256;
 
-            if (gi == 3 || lastX != sX || lastY != sY) {
+            if (gi == 0 || lastX != sX || lastY != sY) {
               _lpgrid.add(cellX, cellY, {sX, sY});
+              lpgridBytes += 2 * sizeof(util::geo::Point<uint8_t>);
               lastX = sX;
               lastY = sY;
             }
@@ -351,10 +344,11 @@ void Requestor::request(const std::string& qry) {
         }
         i++;
 
-        // every 100000 objects, check memory...
+        // every 100000 objects, account for their line point grid entries
         if (i % 100000 == 0) {
           try {
-            checkMem(1, _maxMemory);
+            _mem.reserve(lpgridBytes);
+            lpgridBytes = 0;
           } catch (...) {
 #pragma omp critical
             { ePtr = std::current_exception(); }
@@ -369,18 +363,256 @@ void Requestor::request(const std::string& qry) {
     std::rethrow_exception(ePtr);
   }
 
+  buildInlinePoints();
+
   _ready = true;
 
   LOG(INFO) << "[REQUESTOR] ...done";
 }
 
+// _____________________________________________________________________________
+void Requestor::requestObjects(const std::string& qry) {
+  RequestReader reader(_cache->getBackendURL(), _mem.getBudget(),
+                       _mem.getName() + " ids");
+  LOG(INFO) << "[REQUESTOR] Requesting IDs for query " << qry;
+  reader.requestIds(prepQuery(qry));
+
+  LOG(INFO) << "[REQUESTOR] Done, have " << reader._ids.size()
+            << " ids in total.";
+
+  // join with geoms from GeomCache
+
+  // sort by qlever id
+  LOG(INFO) << "[REQUESTOR] Sorting results by qlever ID...";
+  std::sort(reader._ids.begin(), reader._ids.end());
+  LOG(INFO) << "[REQUESTOR] ... done";
+
+  LOG(INFO) << "[REQUESTOR] Retrieving geoms from cache...";
+
+  // (geom id, result row)
+  auto ret = _cache->getRelObjects(reader._ids);
+  _mem.reserve(sizeof(std::pair<ID_TYPE, ID_TYPE>) * ret.first.size());
+  _objects = std::move(ret.first);
+  _numObjects = ret.second;
+
+  // the geometry order is only worth following if it is spatial
+  if (_cache->isSpatiallySorted()) sortObjects();
+
+  LOG(INFO) << "[REQUESTOR] ... done, got "
+            << _objects.size() << " objects.";
+
+  LOG(INFO) << "[REQUESTOR] Retrieving points dynamically from query...";
+
+  // dynamic points present in query
+  _dynamicPoints = getDynamicPoints(reader._ids);
+  _mem.reserve(sizeof(std::pair<util::geo::FPoint, ID_TYPE>) *
+               _dynamicPoints.size());
+  _numObjects += _dynamicPoints.size();
+
+  LOG(INFO) << "[REQUESTOR] ... done, got "
+            << _dynamicPoints.size() << " points.";
+}
+
+// _____________________________________________________________________________
+void Requestor::resultToDisk() const {
+  if (_resultFile.empty()) return;
+
+  LOG(INFO) << "[REQUESTOR] Writing result to " << _resultFile;
+
+  // write to a temporary file first, concurrent readers only ever see
+  // complete results
+  std::string tmpFile = _resultFile + ".tmp" + std::to_string(getpid());
+  std::ofstream f(tmpFile, std::ios::binary);
+
+  std::string h = _cache->getBuildId();
+  h.insert(h.end(), 99 - h.size(), ' ');
+  f.write(h.c_str(), 100);
+
+  size_t keySize = _resultKey.size();
+  f.write(reinterpret_cast<const char*>(&keySize), sizeof(size_t));
+  f.write(_resultKey.c_str(), keySize);
+  f.write(reinterpret_cast<const char*>(&_numObjects), sizeof(size_t));
+
+  writeVec(&f, _objects);
+  writeVec(&f, _dynamicPoints);
+
+  f.close();
+
+  if (!f.good() || rename(tmpFile.c_str(), _resultFile.c_str()) != 0) {
+    LOG(WARN) << "[REQUESTOR] Could not write result to " << _resultFile;
+    unlink(tmpFile.c_str());
+  }
+}
+
+// _____________________________________________________________________________
+bool Requestor::readResultHeader(std::ifstream* f, std::string* buildId,
+                                 std::string* key) {
+  char tmp[100];
+  f->read(tmp, 100);
+  tmp[99] = 0;
+  *buildId = util::trim(tmp);
+
+  size_t keySize = 0;
+  f->read(reinterpret_cast<char*>(&keySize), sizeof(size_t));
+
+  // not a result file
+  if (!f->good() || keySize > 1024 * 1024 * 1024) return false;
+
+  key->assign(keySize, 0);
+  f->read(&(*key)[0], keySize);
+
+  return f->good();
+}
+
+// _____________________________________________________________________________
+bool Requestor::resultFromDisk() {
+  if (_resultFile.empty()) return false;
+
+  std::ifstream f(_resultFile, std::ios::binary);
+  if (!f.good()) return false;
+
+  std::string buildId, key;
+  if (!readResultHeader(&f, &buildId, &key) ||
+      buildId != _cache->getBuildId()) {
+    // written against another cache build, never valid again
+    LOG(INFO) << "[REQUESTOR] Removing outdated result " << _resultFile;
+    f.close();
+    unlink(_resultFile.c_str());
+    return false;
+  }
+
+  // hash collision
+  if (key != _resultKey) return false;
+
+  LOG(INFO) << "[REQUESTOR] Reading result from " << _resultFile;
+
+  size_t numObjects = 0;
+  f.read(reinterpret_cast<char*>(&numObjects), sizeof(size_t));
+
+  try {
+    readVec(&f, &_objects, &_mem);
+    readVec(&f, &_dynamicPoints, &_mem);
+    if (!f.good()) throw std::runtime_error("Truncated result file");
+  } catch (const std::runtime_error& e) {
+    LOG(WARN) << "[REQUESTOR] Could not read result: " << e.what();
+    _objects.clear();
+    _dynamicPoints.clear();
+    _mem.releaseAll();
+    return false;
+  }
+
+  _numObjects = numObjects;
+
+  LOG(INFO) << "[REQUESTOR] ... done, got " << _objects.size()
+            << " objects and " << _dynamicPoints.size() << " points.";
+
+  return true;
+}
+
+// _____________________________________________________________________________
+void Requestor::serializeToDisk(const std::string& fname) const {
+  std::lock_guard<std::mutex> guard(_m);
+  if (!_ready) throw std::runtime_error("Session not ready");
+
+  std::ofstream f(fname, std::ios::binary);
+
+  std::string h = _cache->getBuildId();
+  h.insert(h.end(), 99 - h.size(), ' ');
+  f.write(h.c_str(), 100);
+
+  size_t querySize = _query.size();
+  f.write(reinterpret_cast<const char*>(&querySize), sizeof(size_t));
+  f.write(_query.c_str(), querySize);
+  f.write(reinterpret_cast<const char*>(&_numObjects), sizeof(size_t));
+
+  writeVec(&f, _objects);
+  writeVec(&f, _dynamicPoints);
+  writeVec(&f, _clusterObjects);
+  writeVec(&f, _pgridCoords);
+  writeVec(&f, _pgridCoordOffs);
+
+  _pgrid.serialize(&f);
+  _lgrid.serialize(&f);
+  _lpgrid.serialize(&f);
+
+  f.close();
+  if (!f.good()) throw std::runtime_error("Could not write " + fname);
+}
+
+// _____________________________________________________________________________
+void Requestor::fromDisk(const std::string& fname) {
+  std::ifstream f(fname, std::ios::binary | std::ios::ate);
+  if (!f.good()) throw std::runtime_error("Could not open " + fname);
+
+  // the file is a close estimate of the memory needed
+  _mem.releaseAll();
+  _mem.reserve(f.tellg());
+  f.seekg(0);
+
+  char tmp[100];
+  f.read(tmp, 100);
+  tmp[99] = 0;
+  if (util::trim(tmp) != _cache->getBuildId()) {
+    throw std::runtime_error("Cache build of " + fname + " does not match");
+  }
+
+  size_t querySize = 0;
+  f.read(reinterpret_cast<char*>(&querySize), sizeof(size_t));
+  _query.resize(querySize);
+  f.read(&_query[0], querySize);
+  f.read(reinterpret_cast<char*>(&_numObjects), sizeof(size_t));
+
+  readVec(&f, &_objects, 0);
+  readVec(&f, &_dynamicPoints, 0);
+  readVec(&f, &_clusterObjects, 0);
+  readVec(&f, &_pgridCoords, 0);
+  readVec(&f, &_pgridCoordOffs, 0);
+
+  _pgrid.deserialize(&f);
+  _lgrid.deserialize(&f);
+  _lpgrid.deserialize(&f);
+}
+
+// _____________________________________________________________________________
+bool Requestor::fromSpillFile() {
+  if (_spillFile.empty()) return false;
+
+  LOG(INFO) << "[REQUESTOR] Restoring session from " << _spillFile;
+
+  try {
+    fromDisk(_spillFile);
+    _ready = true;
+  } catch (const OutOfMemoryError& e) {
+    // keep the file, the request may be retried
+    throw;
+  } catch (const std::exception& e) {
+    LOG(WARN) << "[REQUESTOR] Could not restore session: " << e.what();
+    _mem.releaseAll();
+  }
+
+  unlink(_spillFile.c_str());
+  _spillFile.clear();
+
+  LOG(INFO) << "[REQUESTOR] ...done";
+
+  return _ready;
+}
+
+// _____________________________________________________________________________
+bool Requestor::restore() {
+  std::lock_guard<std::mutex> guard(_m);
+  if (_ready) return true;
+  return fromSpillFile();
+}
+
 // _____________________________________________________________________________
 std::vector<std::pair<std::string, std::string>> Requestor::requestRow(
     uint64_t row) const {
   if (!_cache->ready()) {
     throw std::runtime_error("Geom cache not ready");
   }
-  RequestReader reader(_cache->getBackendURL(), _maxMemory);
+  RequestReader reader(_cache->getBackendURL(), _mem.getBudget(),
+                       _mem.getName() + " row");
   LOG(INFO) << "[REQUESTOR] Requesting single row " << row << " for query "
             << _query;
   auto query = prepQueryRow(_query, row);
@@ -402,7 +634,8 @@ void Requestor::requestRows(
   if (!_cache->ready()) {
     throw std::runtime_error("Geom cache not ready");
   }
-  RequestReader reader(_cache->getBackendURL(), _maxMemory);
+  RequestReader reader(_cache->getBackendURL(), _mem.getBudget(),
+                       _mem.getName() + " rows");
   LOG(INFO) << "[REQUESTOR] Requesting rows for query " << _query;
 
   ReaderCbPair cbPair{&reader, cb};
@@ -417,6 +650,11 @@ void Requestor::requestRows(
           pr->reader->rows = {};
           pr->reader->parse(static_cast<const char*>(contents), realsize);
           pr->cb(pr->reader->rows);
+
+          // the rows of this chunk are consumed, give back their
+          // reservation so that large exports don't add up
+          pr->reader->rows = {};
+          pr->reader->_mem.releaseAll();
         } catch (...) {
           pr->reader->exceptionPtr = std::current_exception();
           return static_cast<size_t>(CURLE_WRITE_ERROR);
@@ -429,27 +667,29 @@ void Requestor::requestRows(
 
 // _____________________________________________________________________________
 std::string Requestor::prepQuery(std::string query) const {
-  std::regex expr("select[^{]*(\\*|[\\?$][A-Z0-9_\\-+]*)+[^{]*\\s*\\{",
-                  std::regex_constants::icase);
-
-  std::string var;
-
-  std::smatch m;
-  std::regex_search(query, m, expr);
+  auto proj = findSparqlProjection(query);
+  if (proj.selectPos == std::string::npos) {
+    throw std::runtime_error("Could not find SELECT clause of query");
+  }
 
-  if (m.size() == 2) var = m[1].str();
+  std::string var = proj.lastVar;
 
   if (var == "*") {
     // if we have a wildcard variable (*), we request the list of variables
-    // from the backend by sending a LIMIT 0 requests.
-    RequestReader reader(_cache->getBackendURL(), _maxMemory);
-    auto cols = reader.requestColumns(query + " LIMIT 0");
+    // from the backend by sending a LIMIT 0 request, once per query
+    std::vector<std::string> cols;
+    if (!_cache->getColumns(query, &cols)) {
+      RequestReader reader(_cache->getBackendURL(), _mem.getBudget(),
+                           _mem.getName() + " columns");
+      cols = reader.requestColumns(query + " LIMIT 0");
+      if (cols.size() > 0) _cache->setColumns(query, cols);
+    }
     if (cols.size() > 0) var = cols.back();
   }
 
-  query = std::regex_replace(query, expr, "SELECT " + var + " WHERE {$&",
-                             std::regex_constants::format_first_only) +
-          "}";
+  // wrap the first select into a subquery
+  query.insert(proj.selectPos, "SELECT " + var + " WHERE {");
+  query += "}";
 
   query += " LIMIT 18446744073709551615";
 
@@ -458,13 +698,14 @@ std::string Requestor::prepQuery(std::string query) const {
 
 // _____________________________________________________________________________
 std::string Requestor::prepQueryRow(std::string query, uint64_t row) const {
-  // replace first select
-  std::regex expr("select[^{]*(\\*|[\\?$][A-Z0-9_\\-+]*)+[^{]*\\s*\\{",
-                  std::regex_constants::icase);
+  auto proj = findSparqlProjection(query);
+  if (proj.selectPos == std::string::npos) {
+    throw std::runtime_error("Could not find SELECT clause of query");
+  }
 
-  query = std::regex_replace(query, expr, "SELECT * {$&",
-                             std::regex_constants::format_first_only) +
-          "}";
+  // wrap the first select into a subquery
+  query.insert(proj.selectPos, "SELECT * {");
+  query += "}";
   query += " OFFSET " + std::to_string(row) + " LIMIT 1";
   return query;
 }
@@ -499,34 +740,39 @@ const ResObj Requestor::getNearest(util::geo::DPoint rp, double rad, double res,
       // points
 
       std::vector<ID_TYPE> ret;
+      std::vector<util::geo::Point<int32_t>> coords;
 
       if (res > 0)
-        _pgrid.get(fullbox, &ret);
+        getPointGridEntries(fullbox, &ret, &coords);
       else
-        _pgrid.get(fbox, &ret);
+        getPointGridEntries(fbox, &ret, &coords);
+
+      const FixedBox fixedBox(fbox);
 
 #pragma omp parallel for num_threads(NUM_THREADS) schedule(static)
-      for (size_t idx = 0; idx < ret.size(); idx++) {
-        auto i = ret[idx];
-        util::geo::FPoint p;
-        if (i >= _objects.size() + _dynamicPoints.size()) {
-          size_t cid = i - _objects.size() - _dynamicPoints.size();
-          auto dp = clusterGeom(cid, res);
-          p = {dp.getX(), dp.getY()};
-        } else {
-          if (i < _objects.size())
-            p = _cache->getPoints()[_objects[i].first];
-          else
-            p = _dynamicPoints[i - _objects.size()].first;
+      for (size_t b = 0; b < ret.size(); b += PointBatch::SIZE) {
+        PointBatch batch;
+
+        for (size_t idx = b; idx < ret.size() && !batch.full(); idx++) {
+          auto i = ret[idx];
+          if (i >= _objects.size() + _dynamicPoints.size()) {
+            size_t cid = i - _objects.size() - _dynamicPoints.size();
+            batch.add(toFixed(clusterGeom(cid, res)), i);
+          } else {
+            batch.add(coords[idx], i);
+          }
         }
 
-        if (!util::geo::contains(p, fbox)) continue;
+        size_t k = batch.cull(fixedBox);
 
-        double d = util::geo::dist(p, frp);
+        for (size_t j = 0; j < k; j++) {
+          auto p = fromFixed({batch.x[batch.idx[j]], batch.y[batch.idx[j]]});
+          double d = util::geo::dist(p, frp);
 
-        if (d < dBestVec[omp_get_thread_num()]) {
-          nearestVec[omp_get_thread_num()] = i;
-          dBestVec[omp_get_thread_num()] = d;
+          if (d < dBestVec[omp_get_thread_num()]) {
+            nearestVec[omp_get_thread_num()] = batch.ids[batch.idx[j]];
+            dBestVec[omp_get_thread_num()] = d;
+          }
         }
       }
     }
@@ -540,71 +786,26 @@ const ResObj Requestor::getNearest(util::geo::DPoint rp, double rad, double res,
 #pragma omp parallel for num_threads(NUM_THREADS) schedule(static)
       for (size_t idx = 0; idx < retL.size(); idx++) {
         const auto& i = retL[idx];
-        auto lBox = _cache->getLineBBox(_objects[i].first - I_OFFSET);
+        size_t lineId = _objects[i].first - I_OFFSET;
+        auto lBox = _cache->getLineBBox(lineId);
         if (!util::geo::intersects(lBox, box)) continue;
 
-        size_t start = _cache->getLine(_objects[i].first - I_OFFSET);
-        size_t end = _cache->getLineEnd(_objects[i].first - I_OFFSET);
+        const auto& dline = extractLineGeom(lineId, res);
 
-        // TODO _____________________ own function
         double d = std::numeric_limits<double>::infinity();
 
-        util::geo::DPoint curPa, curPb;
-        int s = 0;
-
-        size_t gi = 0;
-
-        double mainX = 0;
-        double mainY = 0;
-
-        bool isArea = Requestor::isArea(_objects[i].first - I_OFFSET);
-
-        util::geo::DLine areaBorder;
-
-        for (size_t i = start; i < end; i++) {
-          // extract real geom
-          const auto& cur = _cache->getLinePoints()[i];
-
-          if (isMCoord(cur.getX())) {
-            mainX = rmCoord(cur.getX());
-            mainY = rmCoord(cur.getY());
-            continue;
-          }
-
-          // skip bounding box at beginning
-          gi++;
-          if (gi < 3) continue;
-
-          // extract real geometry
-          util::geo::DPoint curP(
-              (mainX * M_COORD_GRANULARITY + cur.getX()) / 10.0,
-              (mainY * M_COORD_GRANULARITY + cur.getY()) / 10.0);
-
-          if (isArea) areaBorder.push_back(curP);
-
-          if (s == 0) {
-            curPa = curP;
-            s++;
-          } else if (s == 1) {
-            curPb = curP;
-            s++;
-          }
-
-          if (s == 2) {
-            s = 1;
-            double dTmp = util::geo::distToSegment(curPa, curPb, rp);
-            if (dTmp < 0.0001) {
-              d = 0;
-              break;
-            }
-            curPa = curPb;
-            if (dTmp < d) d = dTmp;
+        for (size_t j = 1; j < dline->size(); j++) {
+          double dTmp =
+              util::geo::distToSegment((*dline)[j - 1], (*dline)[j], rp);
+          if (dTmp < 0.0001) {
+            d = 0;
+            break;
           }
+          if (dTmp < d) d = dTmp;
         }
-        // TODO _____________________ own function
 
-        if (isArea) {
-          if (util::geo::contains(rp, util::geo::DPolygon(areaBorder))) {
+        if (Requestor::isArea(lineId)) {
+          if (util::geo::contains(rp, util::geo::DPolygon(*dline))) {
             // set it to rad/4 - this allows selecting smaller objects
             // inside the polgon
             d = rad / 4;
@@ -669,7 +870,7 @@ const ResObj Requestor::getNearest(util::geo::DPoint rp, double rad, double res,
 
     const auto& dline = extractLineGeom(lineId);
 
-    if (isArea && util::geo::contains(rp, util::geo::DPolygon(dline))) {
+    if (isArea && util::geo::contains(rp, util::geo::DPolygon(*dline))) {
       return {true,
               nearestL,
               {frp.getX(), frp.getY()},
@@ -679,7 +880,7 @@ const ResObj Requestor::getNearest(util::geo::DPoint rp, double rad, double res,
               geomPolyGeoms(nearestL, rad / 10)};
     } else {
       if (isArea) {
-        auto p = util::geo::PolyLine<double>(dline).projectOn(rp).p;
+        auto p = util::geo::PolyLine<double>(*dline).projectOn(rp).p;
         auto fp = util::geo::DPoint(p.getX(), p.getY());
         return {true,
                 nearestL,
@@ -689,7 +890,7 @@ const ResObj Requestor::getNearest(util::geo::DPoint rp, double rad, double res,
                 geomLineGeoms(nearestL, rad / 10),
                 geomPolyGeoms(nearestL, rad / 10)};
       } else {
-        auto p = util::geo::PolyLine<double>(dline).projectOn(rp).p;
+        auto p = util::geo::PolyLine<double>(*dline).projectOn(rp).p;
         auto fp = util::geo::DPoint(p.getX(), p.getY());
 
         return {true,
@@ -752,44 +953,19 @@ const ResObj Requestor::getGeom(size_t id, double rad) const {
 }
 
 // _____________________________________________________________________________
-util::geo::DLine Requestor::extractLineGeom(size_t lineId) const {
-  util::geo::DLine dline;
-
-  size_t start = _cache->getLine(lineId);
-  size_t end = _cache->getLineEnd(lineId);
-
-  double mainX = 0;
-  double mainY = 0;
-
-  size_t gi = 0;
-
-  for (size_t i = start; i < end; i++) {
-    // extract real geom
-    const auto& cur = _cache->getLinePoints()[i];
-
-    if (isMCoord(cur.getX())) {
-      mainX = rmCoord(cur.getX());
-      mainY = rmCoord(cur.getY());
-      continue;
-    }
-
-    // skip bounding box at beginning
-    gi++;
-    if (gi < 3) continue;
-
-    util::geo::DPoint curP((mainX * M_COORD_GRANULARITY + cur.getX()) / 10.0,
-                           (mainY * M_COORD_GRANULARITY + cur.getY()) / 10.0);
-    dline.push_back(curP);
-  }
+petrimaps::LineGeomPtr Requestor::extractLineGeom(size_t lineId) const {
+  return _cache->getLineGeom(lineId);
+}
 
-  return dline;
+// _____________________________________________________________________________
+petrimaps::LineGeomPtr Requestor::extractLineGeom(size_t lineId,
+                                                  double res) const {
+  return _cache->getLineGeom(lineId, res);
 }
 
 // _____________________________________________________________________________
 bool Requestor::isArea(size_t lineId) const {
-  size_t end = _cache->getLineEnd(lineId);
-
-  return isMCoord(_cache->getLinePoints()[end - 1].getX());
+  return _cache->isArea(lineId);
 }
 
 // _____________________________________________________________________________
@@ -803,8 +979,8 @@ util::geo::MultiLine<double> Requestor::geomLineGeoms(size_t oid,
     if (_objects[i].first < I_OFFSET ||
         Requestor::isArea(_objects[i].first - I_OFFSET))
       continue;
-    const auto& fline = extractLineGeom(_objects[i].first - I_OFFSET);
-    polys.push_back(util::geo::simplify(fline, eps));
+    const auto& fline = extractLineGeom(_objects[i].first - I_OFFSET, eps);
+    polys.push_back(util::geo::simplify(*fline, eps));
   }
 
   if (oid > 0) {
@@ -814,8 +990,8 @@ util::geo::MultiLine<double> Requestor::geomLineGeoms(size_t oid,
       if (_objects[i].first < I_OFFSET ||
           Requestor::isArea(_objects[i].first - I_OFFSET))
         continue;
-      const auto& fline = extractLineGeom(_objects[i].first - I_OFFSET);
-      polys.push_back(util::geo::simplify(fline, eps));
+      const auto& fline = extractLineGeom(_objects[i].first - I_OFFSET, eps);
+      polys.push_back(util::geo::simplify(*fline, eps));
     }
   }
 
@@ -849,7 +1025,7 @@ util::geo::MultiPoint<double> Requestor::geomPointGeoms(size_t oid,
   for (size_t i = oid;
        i < _objects.size() && _objects[i].second == _objects[oid].second; i++) {
     if (_objects[i].first >= I_OFFSET) continue;
-    auto p = _cache->getPoints()[_objects[i].first];
+    auto p = _cache->getPoint(_objects[i].first);
     points.push_back({p.getX(), p.getY()});
   }
 
@@ -858,7 +1034,7 @@ util::geo::MultiPoint<double> Requestor::geomPointGeoms(size_t oid,
          i < _objects.size() && _objects[i].second == _objects[oid].second;
          i--) {
       if (_objects[i].first >= I_OFFSET) continue;
-      auto p = _cache->getPoints()[_objects[i].first];
+      auto p = _cache->getPoint(_objects[i].first);
       points.push_back({p.getX(), p.getY()});
     }
   }
@@ -877,8 +1053,8 @@ util::geo::MultiPolygon<double> Requestor::geomPolyGeoms(size_t oid,
     if (_objects[i].first < I_OFFSET ||
         !Requestor::isArea(_objects[i].first - I_OFFSET))
       continue;
-    const auto& dline = extractLineGeom(_objects[i].first - I_OFFSET);
-    polys.push_back(util::geo::DPolygon(util::geo::simplify(dline, eps)));
+    const auto& dline = extractLineGeom(_objects[i].first - I_OFFSET, eps);
+    polys.push_back(util::geo::DPolygon(util::geo::simplify(*dline, eps)));
   }
 
   if (oid > 0) {
@@ -888,14 +1064,134 @@ util::geo::MultiPolygon<double> Requestor::geomPolyGeoms(size_t oid,
       if (_objects[i].first < I_OFFSET ||
           !Requestor::isArea(_objects[i].first - I_OFFSET))
         continue;
-      const auto& dline = extractLineGeom(_objects[i].first - I_OFFSET);
-      polys.push_back(util::geo::DPolygon(util::geo::simplify(dline, eps)));
+      const auto& dline = extractLineGeom(_objects[i].first - I_OFFSET, eps);
+      polys.push_back(util::geo::DPolygon(util::geo::simplify(*dline, eps)));
     }
   }
 
   return polys;
 }
 
+// _____________________________________________________________________________
+void Requestor::buildInlinePoints() {
+  size_t numCells = _pgrid.getXWidth() * _pgrid.getYHeight();
+  size_t num = 0;
+
+  for (size_t c = 0; c < numCells; c++) {
+    auto cell = _pgrid.getCell(c % _pgrid.getXWidth(), c / _pgrid.getXWidth());
+    if (cell) num += cell->size();
+  }
+
+  // for large results, the memory is better spent elsewhere
+  if (num > INLINE_POINTS_MAX) {
+    LOG(INFO) << "[REQUESTOR] Not materializing " << num
+              << " point coordinates";
+    return;
+  }
+
+  LOG(INFO) << "[REQUESTOR] Materializing " << num << " point coordinates...";
+
+  _mem.reserve(sizeof(util::geo::Point<int32_t>) * num +
+               sizeof(size_t) * (numCells + 1));
+
+  _pgridCoordOffs.resize(numCells + 1);
+  _pgridCoords.reserve(num);
+
+  for (size_t c = 0; c < numCells; c++) {
+    _pgridCoordOffs[c] = _pgridCoords.size();
+    auto cell = _pgrid.getCell(c % _pgrid.getXWidth(), c / _pgrid.getXWidth());
+    if (!cell) continue;
+    for (auto i : *cell) _pgridCoords.push_back(getPointGridCoord(i));
+  }
+
+  _pgridCoordOffs[numCells] = _pgridCoords.size();
+
+  LOG(INFO) << "[REQUESTOR] ... done";
+}
+
+// _____________________________________________________________________________
+util::geo::Point<int32_t> Requestor::getPointGridCoord(size_t i) const {
+  if (i >= _objects.size() + _dynamicPoints.size()) {
+    i = _clusterObjects[i - _objects.size() - _dynamicPoints.size()].first;
+  }
+
+  if (i < _objects.size()) return _cache->getPoints()[_objects[i].first];
+  return toFixed(_dynamicPoints[i - _objects.size()].first);
+}
+
+// _____________________________________________________________________________
+void Requestor::getPointGridEntries(
+    const util::geo::FBox& box, std::vector<ID_TYPE>* ids,
+    std::vector<util::geo::Point<int32_t>>* coords) const {
+  size_t swX = _pgrid.getCellXFromX(box.getLowerLeft().getX());
+  size_t swY = _pgrid.getCellYFromY(box.getLowerLeft().getY());
+
+  size_t neX = _pgrid.getCellXFromX(box.getUpperRight().getX());
+  size_t neY = _pgrid.getCellYFromY(box.getUpperRight().getY());
+
+  for (size_t x = swX; x <= neX && x < _pgrid.getXWidth(); x++) {
+    for (size_t y = swY; y <= neY && y < _pgrid.getYHeight(); y++) {
+      auto cell = _pgrid.getCell(x, y);
+      if (!cell) continue;
+
+      ids->insert(ids->end(), cell->begin(), cell->end());
+
+      const auto* cellCoords = getPointCellCoords(x, y);
+      if (cellCoords) {
+        coords->insert(coords->end(), cellCoords, cellCoords + cell->size());
+      } else {
+        for (auto i : *cell) coords->push_back(getPointGridCoord(i));
+      }
+    }
+  }
+}
+
+// _____________________________________________________________________________
+void Requestor::sortObjects() {
+  // order the objects by geometry id, which is the storage order of the
+  // geometries in the cache. Objects of the same row (multigeometries) must
+  // stay consecutive, so we sort the row groups by their first geometry id.
+
+  size_t numGroups = 0;
+  for (size_t i = 0; i < _objects.size(); i++) {
+    if (i == 0 || _objects[i].second != _objects[i - 1].second) numGroups++;
+  }
+
+  // the groups and the sorted copy of _objects
+  size_t tmpBytes =
+      sizeof(std::tuple<ID_TYPE, size_t, size_t>) * numGroups +
+      sizeof(std::pair<ID_TYPE, ID_TYPE>) * _objects.size();
+  _mem.reserve(tmpBytes);
+
+  // (first geom id, row, start)
+  std::vector<std::tuple<ID_TYPE, size_t, size_t>> groups;
+  groups.reserve(numGroups);
+  for (size_t i = 0; i < _objects.size(); i++) {
+    if (i == 0 || _objects[i].second != _objects[i - 1].second) {
+      groups.push_back(
+          std::make_tuple(_objects[i].first, _objects[i].second, i));
+    }
+  }
+
+  std::sort(groups.begin(), groups.end());
+
+  std::vector<std::pair<ID_TYPE, ID_TYPE>> objects;
+  objects.reserve(_objects.size());
+
+  for (const auto& g : groups) {
+    for (size_t i = std::get<2>(g);
+         i < _objects.size() && _objects[i].second == std::get<1>(g); i++) {
+      objects.push_back(_objects[i]);
+    }
+  }
+
+  _objects.swap(objects);
+
+  std::vector<std::pair<ID_TYPE, ID_TYPE>>().swap(objects);
+  std::vector<std::tuple<ID_TYPE, size_t, size_t>>().swap(groups);
+  _mem.release(tmpBytes);
+}
+
 // _____________________________________________________________________________
 std::vector<std::pair<util::geo::FPoint, ID_TYPE>> Requestor::getDynamicPoints(
     const std::vector<IdMapping>& ids) const {
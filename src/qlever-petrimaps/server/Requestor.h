@@ -5,7 +5,9 @@
 #ifndef PETRIMAPS_SERVER_REQUESTOR_H_
 #define PETRIMAPS_SERVER_REQUESTOR_H_
 
+#include <atomic>
 #include <chrono>
+#include <fstream>
 #include <functional>
 #include <map>
 #include <memory>
@@ -41,14 +43,44 @@ struct ReaderCbPair {
 
 class Requestor {
  public:
-  Requestor() : _maxMemory(-1) {}
-  Requestor(std::shared_ptr<const GeomCache> cache, size_t maxMemory)
+  Requestor() : _mem(0, "") { touch(); }
+  Requestor(std::shared_ptr<const GeomCache> cache, MemoryBudget* budget,
+            const std::string& name)
       : _cache(cache),
-        _maxMemory(maxMemory),
-        _createdAt(std::chrono::system_clock::now()) {}
+        _mem(budget, name),
+        _createdAt(std::chrono::system_clock::now()) {
+    touch();
+  }
 
   void request(const std::string& query);
 
+  // write the state of a ready session to fname
+  void serializeToDisk(const std::string& fname) const;
+
+  // restore the session from a file written by serializeToDisk() on the
+  // next request() or restore(), the file is removed afterwards
+  void setSpillFile(const std::string& fname) { _spillFile = fname; }
+
+  // restore a spilled session, returns whether the session is ready
+  bool restore();
+
+  // read the joined objects from fname if it holds the result for key
+  // and the current cache build, otherwise write them there after the
+  // request
+  void setResultFile(const std::string& fname, const std::string& key) {
+    _resultFile = fname;
+    _resultKey = key;
+  }
+
+  // read the build id of the geometry cache and the key of a result file
+  // written for setResultFile(), false if the file is not readable
+  static bool readResultHeader(std::ifstream* f, std::string* buildId,
+                               std::string* key);
+
+  const std::string& getBackendURL() const { return _cache->getBackendURL(); }
+
+  std::shared_ptr<const GeomCache> getCache() const { return _cache; }
+
   std::vector<std::pair<std::string, std::string>> requestRow(
       uint64_t row) const;
 
@@ -59,6 +91,23 @@ class Requestor {
 
   const petrimaps::Grid<ID_TYPE, float>& getPointGrid() const { return _pgrid; }
 
+  // fixed point coordinates of the entries of point grid cell (x, y), in
+  // cell order, or nullptr if they were not materialized for this session
+  const util::geo::Point<int32_t>* getPointCellCoords(size_t x,
+                                                      size_t y) const {
+    if (_pgridCoordOffs.empty()) return nullptr;
+    return _pgridCoords.data() + _pgridCoordOffs[y * _pgrid.getXWidth() + x];
+  }
+
+  // fixed point coordinate of point grid entry i, clusters are at their
+  // original position
+  util::geo::Point<int32_t> getPointGridCoord(size_t i) const;
+
+  // point grid entries in box together with their coordinates
+  void getPointGridEntries(
+      const util::geo::FBox& box, std::vector<ID_TYPE>* ids,
+      std::vector<util::geo::Point<int32_t>>* coords) const;
+
   const petrimaps::Grid<ID_TYPE, float>& getLineGrid() const { return _lgrid; }
 
   const petrimaps::Grid<util::geo::Point<uint8_t>, float>& getLinePointGrid()
@@ -79,8 +128,8 @@ class Requestor {
     return _clusterObjects;
   }
 
-  const util::geo::FPoint& getPoint(ID_TYPE id) const {
-    return _cache->getPoints()[id];
+  util::geo::FPoint getPoint(ID_TYPE id) const {
+    return _cache->getPoint(id);
   }
 
   const util::geo::FPoint& getDPoint(ID_TYPE id) const {
@@ -91,10 +140,6 @@ class Requestor {
 
   size_t getLineEnd(ID_TYPE id) const { return _cache->getLineEnd(id); }
 
-  const std::vector<util::geo::Point<int16_t>>& getLinePoints() const {
-    return _cache->getLinePoints();
-  }
-
   util::geo::DBox getLineBBox(ID_TYPE id) const {
     return _cache->getLineBBox(id);
   }
@@ -109,7 +154,13 @@ class Requestor {
   util::geo::MultiPoint<double> geomPointGeoms(size_t oid, double res) const;
   util::geo::MultiPoint<double> geomPointGeoms(size_t oid) const;
 
-  util::geo::DLine extractLineGeom(size_t lineId) const;
+  LineGeomPtr extractLineGeom(size_t lineId) const;
+  LineGeomPtr extractLineGeom(size_t lineId, double res) const;
+
+  // decode line lineId into out, bypassing the line cache
+  void decodeLine(size_t lineId, double res, util::geo::DLine* out) const {
+    _cache->decodeLine(lineId, res, out);
+  }
   bool isArea(size_t lineId) const;
 
   size_t getNumObjects() const { return _numObjects; }
@@ -119,6 +170,19 @@ class Requestor {
     return _createdAt;
   }
 
+  // mark the session as accessed now
+  void touch() {
+    _lastAccess = std::chrono::system_clock::now().time_since_epoch().count();
+  }
+
+  std::chrono::time_point<std::chrono::system_clock> lastAccess() const {
+    return std::chrono::time_point<std::chrono::system_clock>(
+        std::chrono::system_clock::duration(_lastAccess));
+  }
+
+  // bytes currently reserved by this session
+  size_t getMemoryUsage() const { return _mem.getUsed(); }
+
   bool ready() const {
     _m.lock();
     bool ready = _ready;
@@ -131,7 +195,8 @@ class Requestor {
 
   std::shared_ptr<const GeomCache> _cache;
 
-  size_t _maxMemory;
+  // memory reserved for this session
+  MemoryAccount _mem;
 
   std::string prepQuery(std::string query) const;
   std::string prepQueryRow(std::string query, uint64_t row) const;
@@ -139,8 +204,26 @@ class Requestor {
   std::vector<std::pair<util::geo::FPoint, ID_TYPE>> getDynamicPoints(
       const std::vector<IdMapping>& ids) const;
 
+  void sortObjects();
+
+  void buildInlinePoints();
+
+  void fromDisk(const std::string& fname);
+  bool fromSpillFile();
+
+  void requestObjects(const std::string& query);
+  void resultToDisk() const;
+  bool resultFromDisk();
+
   std::string _query;
 
+  // file the session was spilled to, see setSpillFile()
+  std::string _spillFile;
+
+  // persistent result cache, see setResultFile()
+  std::string _resultFile;
+  std::string _resultKey;
+
   mutable std::mutex _m;
 
   std::vector<std::pair<ID_TYPE, ID_TYPE>> _objects;
@@ -149,12 +232,18 @@ class Requestor {
   size_t _numObjects = 0;
 
   petrimaps::Grid<ID_TYPE, float> _pgrid;
+
+  // coordinates of the point grid entries in grid cell order, and the
+  // offset of each cell, see INLINE_POINTS_MAX
+  std::vector<util::geo::Point<int32_t>> _pgridCoords;
+  std::vector<size_t> _pgridCoordOffs;
   petrimaps::Grid<ID_TYPE, float> _lgrid;
   petrimaps::Grid<util::geo::Point<uint8_t>, float> _lpgrid;
 
   bool _ready = false;
 
   std::chrono::time_point<std::chrono::system_clock> _createdAt;
+  std::atomic<std::chrono::system_clock::rep> _lastAccess;
 };
 }  // namespace petrimaps
 
@@ -2,13 +2,16 @@
 // Chair of Algorithms and Data Structures.
 // Authors: Patrick Brosi <brosi@informatik.uni-freiburg.de>
 
+#include <dirent.h>
 #include <png.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <chrono>
 #include <codecvt>
 #include <csignal>
+#include <fstream>
 #include <locale>
 #include <memory>
 #include <random>
@@ -20,6 +23,7 @@
 #include "3rdparty/colorschemes/Spectral.h"
 #include "qlever-petrimaps/build.h"
 #include "qlever-petrimaps/index.h"
+#include "qlever-petrimaps/Sparql.h"
 #include "qlever-petrimaps/server/Requestor.h"
 #include "qlever-petrimaps/server/Server.h"
 #include "qlever-petrimaps/style.h"
@@ -48,17 +52,33 @@ using util::geo::LineSegment;
 using util::geo::webMercToLatLng;
 
 const static double THRESHOLD = 200;
+
+// sessions accessed within the last EVICT_MIN_IDLE seconds are never evicted
+const static int EVICT_MIN_IDLE = 30;
+
+// minutes to wait before a failed background cache rebuild is retried
+const static int REBUILD_RETRY_MINUTES = 5;
 static std::atomic<size_t> _curRow;
 
 // _____________________________________________________________________________
 Server::Server(size_t maxMemory, const std::string& cacheDir, int cacheLifetime,
-               size_t autoThreshold)
-    : _maxMemory(maxMemory),
+               size_t autoThreshold, bool spatialSort, bool compressLines,
+               int indexHashTtl, bool mapCaches)
+    : _memBudget(maxMemory),
       _cacheDir(cacheDir),
       _cacheLifetime(cacheLifetime),
-      _autoThreshold(autoThreshold) {
+      _autoThreshold(autoThreshold),
+      _spatialSort(spatialSort),
+      _compressLines(compressLines),
+      _indexHashTtl(indexHashTtl),
+      _mapCaches(mapCaches) {
   std::thread t(&Server::clearOldSessions, this);
   t.detach();
+
+  if (_indexHashTtl > 0) {
+    std::thread h(&Server::refreshIndexHashes, this);
+    h.detach();
+  }
 }
 
 // _____________________________________________________________________________
@@ -95,6 +115,10 @@ util::http::Answer Server::handle(const util::http::Req& req, int con) const {
       a = handleExportReq(params, con);
     } else if (cmd == "/loadstatus") {
       a = handleLoadStatusReq(params);
+    } else if (cmd == "/stats") {
+      a = handleStatsReq(params);
+    } else if (cmd == "/invalidate") {
+      a = handleInvalidateReq(params);
     } else if (cmd == "/build.js") {
       a = util::http::Answer(
           "200 OK", std::string(build_js, build_js + sizeof build_js /
@@ -163,13 +187,14 @@ util::http::Answer Server::handleHeatMapReq(const Params& pars,
   std::shared_ptr<Requestor> r;
   {
     std::lock_guard<std::mutex> guard(_m);
-    bool has = _rs.count(id);
-    if (!has) {
+    r = getSession(id);
+    if (!r) {
       throw std::invalid_argument("Session not found");
     }
-    r = _rs[id];
   }
 
+  restoreSession(r, id);
+
   LOG(INFO) << "[SERVER] Begin heat for session " << id;
 
   double x1 = std::atof(box[0].c_str());
@@ -214,25 +239,33 @@ util::http::Answer Server::handleHeatMapReq(const Params& pars,
     LOG(INFO) << "[SERVER] Looking up display points...";
     if (res < THRESHOLD) {
       std::vector<ID_TYPE> ret;
+      std::vector<util::geo::Point<int32_t>> coords;
 
       // duplicates are not possible with points
-      r->getPointGrid().get(fbbox, &ret);
+      r->getPointGridEntries(fbbox, &ret, &coords);
+
+      const auto& objs = r->getObjects();
+      const auto& dynPoints = r->getDynamicPoints();
+      const FixedBox fixedBox(fbbox);
+
+      PointBatch batch;
+
+      auto drawBatch = [&]() {
+        size_t k = batch.cull(fixedBox);
+        batch.project(k, bbox, w, h);
+        for (size_t j = 0; j < k; j++) {
+          drawPoint(points[0], points2[0], batch.px[j], batch.py[j], w, h,
+                    style, 1);
+        }
+        batch.n = 0;
+      };
 
       for (size_t j = 0; j < ret.size(); j++) {
         size_t i = ret[j];
 
-        const auto& objs = r->getObjects();
-        const auto& dynPoints = r->getDynamicPoints();
-
         if (i >= objs.size() + dynPoints.size() && style == OBJECTS) {
           size_t cid = i - objs.size() - dynPoints.size();
-          FPoint p;
-          size_t oid = r->getClusters()[cid].first;
-
-          if (oid >= objs.size())
-            p = dynPoints[oid - objs.size()].first;
-          else
-            p = r->getPoint(objs[oid].first);
+          FPoint p = fromFixed(coords[j]);
 
           if (!contains(p, fbbox)) continue;
 
@@ -247,23 +280,13 @@ util::http::Answer Server::handleHeatMapReq(const Params& pars,
           drawPoint(points[0], points2[0], px, py, w, h, style, 1);
           drawLine(image.data(), ppx, ppy, px, py, w, h);
         } else {
-          if (i >= objs.size() + dynPoints.size())
-            i = r->getClusters()[i - objs.size() - dynPoints.size()].first;
-
-          FPoint p;
-          if (i < objs.size())
-            p = r->getPoint(objs[i].first);
-          else
-            p = r->getDPoint(i - objs.size());
+          batch.add(coords[j], i);
 
-          if (!contains(p, fbbox)) continue;
-
-          int px = ((p.getX() - bbox.getLowerLeft().getX()) / mercW) * w;
-          int py = h - ((p.getY() - bbox.getLowerLeft().getY()) / mercH) * h;
-
-          drawPoint(points[0], points2[0], px, py, w, h, style, 1);
+          if (batch.full()) drawBatch();
         }
       }
+
+      drawBatch();
     } else {
       // they intersect, we checked this above
       auto iBox = intersection(r->getPointGrid().getBBox(), fbbox);
@@ -297,25 +320,30 @@ util::http::Answer Server::handleHeatMapReq(const Params& pars,
                       points2[omp_get_thread_num()], px, py, w, h, style,
                       cell->size());
           } else {
-            for (auto i : *cell) {
-              if (i >= r->getObjects().size() + r->getDynamicPoints().size()) {
-                i = r->getClusters()[i - r->getObjects().size() -
-                                     r->getDynamicPoints().size()]
-                        .first;
+            PointBatch batch;
+
+            auto drawBatch = [&]() {
+              // no culling, points near the border still contribute
+              size_t k = batch.all();
+              batch.project(k, bbox, w, h);
+              for (size_t j = 0; j < k; j++) {
+                drawPoint(points[omp_get_thread_num()],
+                          points2[omp_get_thread_num()], batch.px[j],
+                          batch.py[j], w, h, style, 1);
               }
+              batch.n = 0;
+            };
 
-              FPoint p;
-              if (i < r->getObjects().size())
-                p = r->getPoint(r->getObjects()[i].first);
-              else
-                p = r->getDPoint(i - r->getObjects().size());
-
-              int px = ((p.getX() - bbox.getLowerLeft().getX()) / mercW) * w;
-              int py =
-                  h - ((p.getY() - bbox.getLowerLeft().getY()) / mercH) * h;
-              drawPoint(points[omp_get_thread_num()],
-                        points2[omp_get_thread_num()], px, py, w, h, style, 1);
+            const auto* coords = r->getPointCellCoords(x, y);
+
+            for (size_t k = 0; k < cell->size(); k++) {
+              auto i = (*cell)[k];
+              batch.add(coords ? coords[k] : r->getPointGridCoord(i), i);
+
+              if (batch.full()) drawBatch();
             }
+
+            drawBatch();
           }
         }
       }
@@ -335,67 +363,34 @@ util::http::Answer Server::handleHeatMapReq(const Params& pars,
       // sort to avoid duplicates
       std::sort(ret.begin(), ret.end());
 
+      // each line is only needed once here, decode them into a reused
+      // buffer instead of going through the line cache
+      util::geo::DLine dline;
+
       for (size_t idx = 0; idx < ret.size(); idx++) {
         if (idx > 0 && ret[idx] == ret[idx - 1]) continue;
         auto lid = r->getObjects()[ret[idx]].first;
         const auto& lbox = r->getLineBBox(lid - I_OFFSET);
         if (!intersects(lbox, bbox)) continue;
 
-        size_t gi = 0;
-
-        size_t start = r->getLine(lid - I_OFFSET);
-        size_t end = r->getLineEnd(lid - I_OFFSET);
+        dline.clear();
+        r->decodeLine(lid - I_OFFSET, res, &dline);
 
-        // ___________________________________
         bool isects = false;
 
-        DPoint curPa, curPb;
-        int s = 0;
-
-        double mainX = 0;
-        double mainY = 0;
-        for (size_t i = start; i < end; i++) {
-          // extract real geom
-          const auto& cur = r->getLinePoints()[i];
-
-          if (isMCoord(cur.getX())) {
-            mainX = rmCoord(cur.getX());
-            mainY = rmCoord(cur.getY());
-            continue;
-          }
-
-          // skip bounding box at beginning
-          gi++;
-          if (gi < 3) continue;
-
-          // extract real geometry
-          const DPoint curP((mainX * M_COORD_GRANULARITY + cur.getX()) / 10.0,
-                            (mainY * M_COORD_GRANULARITY + cur.getY()) / 10.0);
-          if (s == 0) {
-            curPa = curP;
-            s++;
-          } else if (s == 1) {
-            curPb = curP;
-            s++;
-          }
-
-          if (s == 2) {
-            s = 1;
-            if (intersects(LineSegment<double>(curPa, curPb), bbox)) {
-              isects = true;
-              break;
-            }
-            curPa = curPb;
+        for (size_t i = 1; i < dline.size(); i++) {
+          if (intersects(LineSegment<double>(dline[i - 1], dline[i]),
+                         bbox)) {
+            isects = true;
+            break;
           }
         }
-        // ___________________________________
 
         if (!isects) continue;
 
         // the factor depends on the render thickness of the line, make
         // this configurable!
-        const auto& denseLine =
-            densify(r->extractLineGeom(lid - I_OFFSET), res);
+        const auto& denseLine = densify(dline, res);
 
         for (const auto& p : denseLine) {
           int px = ((p.getX() - bbox.getLowerLeft().getX()) / mercW) * w;
@@ -567,13 +562,14 @@ util::http::Answer Server::handleGeoJSONReq(const Params& pars) const {
 
   {
     std::lock_guard<std::mutex> guard(_m);
-    bool has = _rs.count(id);
-    if (!has) {
+    reqor = getSession(id);
+    if (!reqor) {
       throw std::invalid_argument("Session not found");
     }
-    reqor = _rs[id];
   }
 
+  restoreSession(reqor, id);
+
   if (!reqor->ready()) {
     throw std::invalid_argument("Session not ready.");
   }
@@ -682,13 +678,14 @@ util::http::Answer Server::handlePosReq(const Params& pars) const {
   std::shared_ptr<Requestor> reqor;
   {
     std::lock_guard<std::mutex> guard(_m);
-    bool has = _rs.count(id);
-    if (!has) {
+    reqor = getSession(id);
+    if (!reqor) {
       throw std::invalid_argument("Session not found");
     }
-    reqor = _rs[id];
   }
 
+  restoreSession(reqor, id);
+
   if (!reqor->ready()) {
     throw std::invalid_argument("Session not ready.");
   }
@@ -786,7 +783,6 @@ util::http::Answer Server::handleLoadReq(const Params& pars) const {
 
   LOG(INFO) << "[SERVER] Queried backend is " << backend;
 
-  createCache(backend);
   loadCache(backend);
 
   auto answ = util::http::Answer("200 OK", "{}");
@@ -806,45 +802,76 @@ util::http::Answer Server::handleQueryReq(const Params& pars) const {
   LOG(INFO) << "[SERVER] Queried backend is " << backend;
   LOG(INFO) << "[SERVER] Query is:\n" << query;
 
-  createCache(backend);
-  std::string indexHash = loadCache(backend);
+  // the cache the session is built on, _caches may already hold another
+  // one for backend (rebuilt, or dropped after a failed load)
+  auto cache = loadCache(backend);
 
-  std::string queryId = backend + "$" + indexHash + "$" + query;
+  std::string normQuery = normalizeSparql(query);
+  bool cacheable = isSparqlCacheable(query);
 
   std::shared_ptr<Requestor> reqor;
   std::string sessionId;
 
   {
     std::lock_guard<std::mutex> guard(_m);
-    if (_queryCache.count(queryId)) {
+
+    // equivalent queries share a session
+    std::string queryId =
+        backend + "$" + cache->getIndexHash() + "$" + normQuery;
+
+    if (cacheable && _queryCache.count(queryId)) {
+      _queryCacheHits++;
       sessionId = _queryCache[queryId];
-      reqor = _rs[sessionId];
+      reqor = getSession(sessionId);
     } else {
-      reqor = std::shared_ptr<Requestor>(
-          new Requestor(_caches[backend], _maxMemory));
+      if (cacheable) {
+        _queryCacheMisses++;
+      } else {
+        _queryCacheUncacheable++;
+      }
 
       sessionId = getSessionId();
 
+      reqor = std::shared_ptr<Requestor>(
+          new Requestor(cache, &_memBudget, "session " + sessionId));
+
       _rs[sessionId] = reqor;
-      if (util::toLower(query).find("rand()") == std::string::npos)
+      if (cacheable) {
         _queryCache[queryId] = sessionId;
+
+        if (!_cacheDir.empty()) {
+          std::stringstream fname;
+          fname << _cacheDir << "/result-" << std::hex << fnv1a(queryId);
+          reqor->setResultFile(fname.str(), queryId);
+        }
+      }
     }
   }
 
-  try {
-    reqor->request(query);
-  } catch (OutOfMemoryError& ex) {
-    LOG(ERROR) << ex.what() << backend;
+  while (true) {
+    try {
+      reqor->request(query);
+      break;
+    } catch (OutOfMemoryError& ex) {
+      // the retry gives back what the session already reserved, make room
+      // for that plus what it additionally wanted
+      if (evictSessions(reqor->getMemoryUsage() + ex.getWant(), sessionId)) {
+        LOG(INFO) << "[SERVER] Retrying query for session " << sessionId;
+        continue;
+      }
 
-    // delete cache, is now in unready state
-    {
-      std::lock_guard<std::mutex> guard(_m);
-      clearSession(sessionId);
-    }
+      {
+        // delete cache, is now in unready state
+        std::lock_guard<std::mutex> guard(_m);
+        clearSession(sessionId);
+      }
+
+      LOG(ERROR) << ex.what() << backend;
 
-    auto answ = util::http::Answer("406 Not Acceptable", ex.what());
-    answ.params["Content-Type"] = "application/json; charset=utf-8";
-    return answ;
+      auto answ = util::http::Answer("406 Not Acceptable", ex.what());
+      answ.params["Content-Type"] = "application/json; charset=utf-8";
+      return answ;
+    }
   }
 
   auto bbox = reqor->getPointGrid().getBBox();
@@ -978,10 +1005,15 @@ void Server::writePNG(const unsigned char* data, size_t w, size_t h,
 
 // _____________________________________________________________________________
 void Server::clearSession(const std::string& id) const {
-  if (_rs.count(id)) {
+  if (_rs.count(id) || _spilled.count(id)) {
     LOG(INFO) << "[SERVER] Clearing session " << id;
     _rs.erase(id);
 
+    if (_spilled.count(id)) {
+      unlink(_spilled[id].file.c_str());
+      _spilled.erase(id);
+    }
+
     for (auto it = _queryCache.cbegin(); it != _queryCache.cend();) {
       if (it->second == id) {
         it = _queryCache.erase(it);
@@ -997,30 +1029,269 @@ void Server::clearSessions() const {
   LOG(INFO) << "[SERVER] Clearing all sessions...";
   _rs.clear();
   _queryCache.clear();
+
+  for (const auto& s : _spilled) unlink(s.second.file.c_str());
+  _spilled.clear();
 }
 
 // _____________________________________________________________________________
 void Server::clearOldSessions() const {
   while (true) {
-    std::this_thread::sleep_for(std::chrono::minutes(_cacheLifetime));
+    std::this_thread::sleep_for(std::chrono::minutes(1));
+
+    // build ids of the caches whose outdated results have to be swept
+    std::map<std::string, std::string> sweep;
 
+    {
+    std::lock_guard<std::mutex> guard(_m);
     std::vector<std::string> toDel;
 
     for (const auto& i : _rs) {
+      // referenced outside of _rs, currently in use
+      if (i.second.use_count() > 1) continue;
+
       if (std::chrono::duration_cast<std::chrono::minutes>(
-              std::chrono::system_clock::now() - i.second->createdAt())
-              .count() >= 1) {
+              std::chrono::system_clock::now() - i.second->lastAccess())
+              .count() >= _cacheLifetime) {
+        toDel.push_back(i.first);
+      }
+    }
+
+    for (const auto& i : _spilled) {
+      if (std::chrono::duration_cast<std::chrono::minutes>(
+              std::chrono::system_clock::now() - i.second.lastAccess)
+              .count() >= _cacheLifetime) {
         toDel.push_back(i.first);
       }
     }
 
-    std::lock_guard<std::mutex> guard(_m);
     for (const auto& id : toDel) {
       clearSession(id);
     }
+
+    for (const auto& c : _caches) {
+      if (!c.second->ready()) continue;
+      const auto& buildId = c.second->getBuildId();
+      if (_sweptBuildIds[c.first] != buildId) sweep[c.first] = buildId;
+    }
+    }
+
+    if (_cacheDir.size() && sweep.size()) {
+      sweepResults(sweep);
+
+      std::lock_guard<std::mutex> guard(_m);
+      for (const auto& s : sweep) _sweptBuildIds[s.first] = s.second;
+    }
   }
 }
 
+// _____________________________________________________________________________
+void Server::sweepResults(
+    const std::map<std::string, std::string>& buildIds) const {
+  // results are only valid for the cache build they were written for, the
+  // results of backends not served here may belong to another instance
+  DIR* dir = opendir(_cacheDir.c_str());
+  if (!dir) return;
+
+  size_t removed = 0;
+
+  struct dirent* e;
+  while ((e = readdir(dir))) {
+    std::string name = e->d_name;
+    if (name.compare(0, 7, "result-") != 0) continue;
+
+    // still being written
+    if (name.find(".tmp") != std::string::npos) continue;
+
+    std::string fname = _cacheDir + "/" + name;
+    std::ifstream f(fname, std::ios::binary);
+
+    std::string buildId, key;
+    if (!Requestor::readResultHeader(&f, &buildId, &key)) continue;
+
+    auto it = buildIds.find(key.substr(0, key.find('$')));
+    if (it == buildIds.end() || it->second == buildId) continue;
+
+    f.close();
+    if (unlink(fname.c_str()) == 0) removed++;
+  }
+
+  closedir(dir);
+
+  if (removed) {
+    LOG(INFO) << "[SERVER] Removed " << removed << " outdated results from "
+              << _cacheDir;
+  }
+}
+
+// _____________________________________________________________________________
+void Server::refreshIndexHashes() const {
+  while (true) {
+    // refresh before the cached hashes expire
+    std::this_thread::sleep_for(
+        std::chrono::seconds(std::max(1, _indexHashTtl / 2)));
+
+    std::vector<std::shared_ptr<GeomCache>> caches;
+    {
+      std::lock_guard<std::mutex> guard(_m);
+      for (const auto& c : _caches) caches.push_back(c.second);
+    }
+
+    for (const auto& c : caches) {
+      if (c->ready()) c->refreshIndexHash();
+    }
+  }
+}
+
+// _____________________________________________________________________________
+bool Server::evictSessions(size_t bytes, const std::string& keep) const {
+  // the victims are chosen under _m, but written to disk outside of it, so
+  // that other requests are not blocked by that. _m must not be held.
+  struct Victim {
+    std::string id;
+    std::shared_ptr<Requestor> r;
+    std::chrono::system_clock::time_point lastAccess;
+    std::string file;
+  };
+  std::vector<Victim> victims;
+  bool shrunk = false;
+
+  {
+    std::lock_guard<std::mutex> guard(_m);
+
+    // decoded line geometries are the cheapest to give up
+    for (const auto& c : _caches) {
+      size_t free = _memBudget.getMax() - _memBudget.getUsed();
+      if (free >= bytes) break;
+      if (c.second->shrinkLineCache(bytes - free)) shrunk = true;
+    }
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<std::pair<std::chrono::system_clock::time_point, std::string>>
+        cands;
+
+    for (const auto& i : _rs) {
+      // referenced outside of _rs, currently in use (or being evicted)
+      if (i.first == keep || i.second.use_count() > 1) continue;
+
+      // protect sessions which are actively being browsed
+      if (now - i.second->lastAccess() < std::chrono::seconds(EVICT_MIN_IDLE))
+        continue;
+
+      cands.push_back({i.second->lastAccess(), i.first});
+    }
+
+    // least recently used first
+    std::sort(cands.begin(), cands.end());
+
+    size_t freed = 0;
+
+    for (const auto& c : cands) {
+      if (_memBudget.getMax() - _memBudget.getUsed() + freed >= bytes) break;
+      const auto& r = _rs[c.second];
+      LOG(INFO) << "[SERVER] Evicting idle session " << c.second << " ("
+                << r->getMemoryUsage() << " bytes)";
+      freed += r->getMemoryUsage();
+      victims.push_back({c.second, r, c.first, ""});
+    }
+  }
+
+  if (victims.empty()) return shrunk;
+
+  for (auto& v : victims) v.file = spillSession(v.id, *v.r);
+
+  bool evicted = false;
+
+  std::lock_guard<std::mutex> guard(_m);
+
+  for (const auto& v : victims) {
+    auto it = _rs.find(v.id);
+
+    // cleared or accessed again in the meantime, keep it as it is
+    if (it == _rs.end() || it->second != v.r || v.r.use_count() > 2 ||
+        v.r->lastAccess() != v.lastAccess) {
+      if (v.file.size()) unlink(v.file.c_str());
+      continue;
+    }
+
+    if (v.file.size()) {
+      // the query cache still points to the session, it is restored on
+      // access
+      _spilled[v.id] = {v.r->getCache(), v.file, v.lastAccess};
+      _rs.erase(it);
+    } else {
+      clearSession(v.id);
+    }
+
+    evicted = true;
+  }
+
+  // the victims are freed after _m was released
+  return evicted || shrunk;
+}
+
+// _____________________________________________________________________________
+std::string Server::spillSession(const std::string& id,
+                                 const Requestor& r) const {
+  if (_cacheDir.empty()) return "";
+  if (!r.ready()) return "";
+
+  std::string fname = _cacheDir + "/session-" + id;
+
+  LOG(INFO) << "[SERVER] Spilling session " << id << " to " << fname;
+
+  try {
+    r.serializeToDisk(fname);
+  } catch (const std::exception& e) {
+    LOG(WARN) << "[SERVER] Could not spill session " << id << ": "
+              << e.what();
+    unlink(fname.c_str());
+    return "";
+  }
+
+  return fname;
+}
+
+// _____________________________________________________________________________
+void Server::restoreSession(const std::shared_ptr<Requestor>& r,
+                            const std::string& id) const {
+  while (true) {
+    try {
+      r->restore();
+
+      // fail here if the line points of the cache could not be read, and
+      // not inside of the parallel regions of the handlers
+      r->getCache()->waitForLines();
+      return;
+    } catch (OutOfMemoryError& ex) {
+      // the retry gives back what the session already reserved
+      if (!evictSessions(r->getMemoryUsage() + ex.getWant(), id)) throw;
+      LOG(INFO) << "[SERVER] Retrying restore of session " << id;
+    }
+  }
+}
+
+// _____________________________________________________________________________
+std::shared_ptr<petrimaps::Requestor> Server::getSession(
+    const std::string& id) const {
+  if (!_rs.count(id) && _spilled.count(id)) {
+    // the state is read back lazily by Requestor::restore() or request(),
+    // outside of the server lock
+    const auto& s = _spilled[id];
+    auto r = std::shared_ptr<Requestor>(
+        new Requestor(s.cache, &_memBudget, "session " + id));
+    r->setSpillFile(s.file);
+    _rs[id] = r;
+    _spilled.erase(id);
+  }
+
+  auto it = _rs.find(id);
+  if (it == _rs.end()) return std::shared_ptr<Requestor>();
+
+  it->second->touch();
+  return it->second;
+}
+
 // _____________________________________________________________________________
 util::http::Answer Server::handleExportReq(const Params& pars, int sock) const {
   // ignore SIGPIPE
@@ -1036,13 +1307,14 @@ util::http::Answer Server::handleExportReq(const Params& pars, int sock) const {
 
   {
     std::lock_guard<std::mutex> guard(_m);
-    bool has = _rs.count(id);
-    if (!has) {
+    reqor = getSession(id);
+    if (!reqor) {
       throw std::invalid_argument("Session not found");
     }
-    reqor = _rs[id];
   }
 
+  restoreSession(reqor, id);
+
   if (!reqor->ready()) {
     throw std::invalid_argument("Session not ready.");
   }
@@ -1171,8 +1443,7 @@ util::http::Answer Server::handleLoadStatusReq(const Params& pars) const {
   if (pars.count("backend") == 0 || pars.find("backend")->second.empty())
     throw std::invalid_argument("No backend (?backend=) specified.");
   auto backend = pars.find("backend")->second;
-  createCache(backend);
-  std::shared_ptr<GeomCache> cache = _caches[backend];
+  auto cache = createCache(backend);
 
   // We have 3 loading stages:
   // 1) Filling geometry cache / reading cache from disk
@@ -1202,6 +1473,83 @@ util::http::Answer Server::handleLoadStatusReq(const Params& pars) const {
   return ans;
 }
 
+// _____________________________________________________________________________
+util::http::Answer Server::handleStatsReq(const Params& pars) const {
+  UNUSED(pars);
+
+  std::stringstream json;
+  json << "{\"memory\": {\"max\": " << _memBudget.getMax()
+       << ", \"used\": " << _memBudget.getUsed() << ", \"accounts\": [";
+
+  bool first = true;
+  for (const auto& acc : _memBudget.getAccounts()) {
+    std::string name = acc.first;
+    util::replaceAll(name, "\\", "\\\\");
+    util::replaceAll(name, "\"", "\\\"");
+    if (!first) json << ", ";
+    json << "{\"name\": \"" << name << "\", \"bytes\": " << acc.second
+         << "}";
+    first = false;
+  }
+
+  json << "]}";
+
+  {
+    std::lock_guard<std::mutex> guard(_m);
+    json << ", \"queryCache\": {\"hits\": " << _queryCacheHits
+         << ", \"misses\": " << _queryCacheMisses
+         << ", \"uncacheable\": " << _queryCacheUncacheable
+         << ", \"entries\": " << _queryCache.size()
+         << ", \"sessions\": " << _rs.size()
+         << ", \"spilledSessions\": " << _spilled.size() << "}";
+
+    // the resident part is page cache, it is not reserved against -m
+    size_t mapped = 0, resident = 0, lineHits = 0, lineMisses = 0;
+    for (const auto& c : _caches) {
+      mapped += c.second->getMappedBytes();
+      resident += c.second->getMappedResidentBytes();
+      lineHits += c.second->getLineCache().getHits();
+      lineMisses += c.second->getLineCache().getMisses();
+    }
+    json << ", \"mappedBytes\": " << mapped
+         << ", \"mappedResidentBytes\": " << resident
+         << ", \"lineCache\": {\"hits\": " << lineHits
+         << ", \"misses\": " << lineMisses << "}";
+  }
+
+  json << "}";
+
+  auto answ = util::http::Answer("200 OK", json.str());
+  answ.params["Content-Type"] = "application/json; charset=utf-8";
+  return answ;
+}
+
+// _____________________________________________________________________________
+util::http::Answer Server::handleInvalidateReq(const Params& pars) const {
+  // the caches are not called into while _m is held
+  std::vector<std::shared_ptr<GeomCache>> caches;
+
+  {
+    std::lock_guard<std::mutex> guard(_m);
+
+    if (pars.count("backend") && !pars.find("backend")->second.empty()) {
+      auto backend = pars.find("backend")->second;
+      LOG(INFO) << "[SERVER] Invalidating index hash of " << backend;
+      auto it = _caches.find(backend);
+      if (it != _caches.end()) caches.push_back(it->second);
+    } else {
+      LOG(INFO) << "[SERVER] Invalidating all index hashes";
+      for (const auto& c : _caches) caches.push_back(c.second);
+    }
+  }
+
+  for (const auto& c : caches) c->invalidateIndexHash();
+
+  auto answ = util::http::Answer("200 OK", "{}");
+  answ.params["Content-Type"] = "application/json; charset=utf-8";
+  return answ;
+}
+
 // _____________________________________________________________________________
 void Server::drawPoint(std::vector<uint32_t>& points,
                        std::vector<double>& points2, int px, int py, int w,
@@ -1247,7 +1595,8 @@ double Server::getLoadStatusPercent() const {
 }
 
 // _____________________________________________________________________________
-void Server::createCache(const std::string& backend) const {
+std::shared_ptr<petrimaps::GeomCache> Server::createCache(
+    const std::string& backend) const {
   std::shared_ptr<GeomCache> cache;
 
   {
@@ -1255,28 +1604,171 @@ void Server::createCache(const std::string& backend) const {
     if (_caches.count(backend)) {
       cache = _caches[backend];
     } else {
-      cache = std::shared_ptr<GeomCache>(new GeomCache(backend));
+      cache = std::shared_ptr<GeomCache>(
+          new GeomCache(backend, &_memBudget, _spatialSort, _compressLines,
+                        _indexHashTtl, _mapCaches));
       _caches[backend] = cache;
     }
   }
+
+  return cache;
 }
 
 // _____________________________________________________________________________
-std::string Server::loadCache(const std::string& backend) const {
-  std::shared_ptr<GeomCache> cache = _caches[backend];
+std::shared_ptr<petrimaps::GeomCache> Server::loadCache(
+    const std::string& backend) const {
+  auto cache = createCache(backend);
+
+  if (cache->ready()) {
+    auto indexHash = cache->getRemoteIndexHash();
+
+    if (cache->linesFailed()) {
+      LOG(WARN) << "[SERVER] Line points of the cache for " << backend
+                << " could not be read, reloading it";
+      if (!rebuildCache(backend)) return loadCache(backend);
+    }
+
+    // keep serving the old index while the new one is built, and if the
+    // backend could not be reached
+    if (indexHash.size() && indexHash != cache->getIndexHash()) {
+      LOG(INFO) << "[SERVER] Loaded index hash (" << cache->getIndexHash()
+                << ") and remote index hash (" << indexHash
+                << ") dont match.";
+
+      // the old cache was dropped, load the new one right away
+      if (!rebuildCache(backend)) return loadCache(backend);
+    }
+
+    return cache;
+  }
 
   try {
-    return cache->load(_cacheDir);
+    cache->load(_cacheDir);
+    return cache;
   } catch (...) {
     std::lock_guard<std::mutex> guard(_m);
 
+    // only drop our cache, not one another thread already replaced it with
     auto it = _caches.find(backend);
-    if (it != _caches.end()) _caches.erase(it);
+    if (it != _caches.end() && it->second == cache) _caches.erase(it);
 
     throw;
   }
 }
 
+// _____________________________________________________________________________
+bool Server::rebuildCache(const std::string& backend) const {
+  // while the rebuilt cache is loaded, the old one is still served, so
+  // the peak memory is about twice the size of the cache. The size of the
+  // old cache is reserved up front and handed to the new one.
+  std::shared_ptr<MemoryAccount> headroom(
+      new MemoryAccount(&_memBudget, "cache rebuild " + backend));
+
+  size_t need = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(_m);
+    if (_rebuilding.count(backend)) return true;
+
+    auto failed = _rebuildFailed.find(backend);
+    if (failed != _rebuildFailed.end() &&
+        std::chrono::steady_clock::now() - failed->second <
+            std::chrono::minutes(REBUILD_RETRY_MINUTES)) {
+      return true;
+    }
+
+    auto it = _caches.find(backend);
+    if (it == _caches.end()) return true;
+
+    need = it->second->getMemoryUsage();
+    _rebuilding.insert(backend);
+  }
+
+  evictSessions(need, "");
+
+  try {
+    headroom->reserve(need);
+  } catch (const OutOfMemoryError& e) {
+    LOG(WARN) << "[SERVER] Not enough memory to rebuild the cache for "
+              << backend << " next to the old one (" << e.what()
+              << "), rebuilding in place";
+    std::lock_guard<std::mutex> guard(_m);
+    _rebuilding.erase(backend);
+    rebuildCacheInPlace(backend);
+    return false;
+  }
+
+  LOG(INFO) << "[SERVER] Rebuilding cache for " << backend
+            << " in the background";
+
+  std::thread t([this, backend, headroom]() {
+    std::shared_ptr<GeomCache> fresh(
+        new GeomCache(backend, &_memBudget, _spatialSort, _compressLines,
+                      _indexHashTtl, _mapCaches));
+    fresh->prepayMemory(headroom.get());
+
+    bool ok = false;
+    bool oom = false;
+    try {
+      fresh->load(_cacheDir);
+      ok = true;
+    } catch (const OutOfMemoryError& e) {
+      LOG(ERROR) << "[SERVER] Could not rebuild cache for " << backend
+                 << " next to the old one: " << e.what();
+      oom = true;
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "[SERVER] Could not rebuild cache for " << backend
+                 << ": " << e.what();
+    }
+
+    fresh->releasePrepaid();
+
+    std::lock_guard<std::mutex> guard(_m);
+    _rebuilding.erase(backend);
+
+    if (oom) {
+      // retrying would run out of memory again
+      fresh.reset();
+      rebuildCacheInPlace(backend);
+    } else if (ok) {
+      // sessions keep their reference to the old cache until they are gone
+      LOG(INFO) << "[SERVER] Swapping in rebuilt cache for " << backend;
+      _caches[backend] = fresh;
+      _rebuildFailed.erase(backend);
+    } else {
+      _rebuildFailed[backend] = std::chrono::steady_clock::now();
+    }
+  });
+  t.detach();
+
+  return true;
+}
+
+// _____________________________________________________________________________
+void Server::rebuildCacheInPlace(const std::string& backend) const {
+  // _m is held by the caller. The sessions on the old cache are dropped, so
+  // that it is freed once the requests still running on it are done, and
+  // the next request loads the new index.
+  auto old = _caches[backend];
+
+  std::vector<std::string> ids;
+  for (const auto& r : _rs) {
+    if (r.second->getCache() == old) ids.push_back(r.first);
+  }
+  for (const auto& s : _spilled) {
+    if (s.second.cache == old) ids.push_back(s.first);
+  }
+  for (const auto& id : ids) clearSession(id);
+
+  LOG(INFO) << "[SERVER] Dropped cache for " << backend << " and "
+            << ids.size() << " sessions on it";
+
+  old.reset();
+  _caches[backend] = std::shared_ptr<GeomCache>(
+      new GeomCache(backend, &_memBudget, _spatialSort, _compressLines,
+                    _indexHashTtl, _mapCaches));
+}
+
 // _____________________________________________________________________________
 void Server::drawLine(unsigned char* image, int x0, int y0, int x1, int y1,
                       int w, int h) const {
@@ -5,9 +5,11 @@
 #ifndef PETRIMAPS_SERVER_SERVER_H_
 #define PETRIMAPS_SERVER_SERVER_H_
 
+#include <chrono>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -22,10 +24,20 @@ typedef std::map<std::string, std::string> Params;
 
 enum MapStyle { HEATMAP, OBJECTS };
 
+// a session evicted to the cache dir, see Requestor::serializeToDisk(). It
+// keeps the geometry cache it was built on, which may have been replaced by
+// a rebuild in the meantime.
+struct SpilledSession {
+  std::shared_ptr<const GeomCache> cache;
+  std::string file;
+  std::chrono::time_point<std::chrono::system_clock> lastAccess;
+};
+
 class Server : public util::http::Handler {
  public:
   explicit Server(size_t maxMemory, const std::string& cacheDir,
-                  int cacheLifetime, size_t autoThreshold);
+                  int cacheLifetime, size_t autoThreshold, bool spatialSort,
+                  bool compressLines, int indexHashTtl, bool mapCaches);
 
   virtual util::http::Answer handle(const util::http::Req& request,
                                     int connection) const;
@@ -42,13 +54,28 @@ class Server : public util::http::Handler {
 
   util::http::Answer handleExportReq(const Params& pars, int sock) const;
   util::http::Answer handleLoadStatusReq(const Params& pars) const;
+  util::http::Answer handleStatsReq(const Params& pars) const;
+  util::http::Answer handleInvalidateReq(const Params& pars) const;
 
-  void createCache(const std::string& backend) const;
-  std::string loadCache(const std::string& backend) const;
+  // the cache of backend, created if there is none yet
+  std::shared_ptr<GeomCache> createCache(const std::string& backend) const;
+
+  // the loaded cache of backend, which may have been replaced in _caches
+  // by the time this returns
+  std::shared_ptr<GeomCache> loadCache(const std::string& backend) const;
+  bool rebuildCache(const std::string& backend) const;
+  void rebuildCacheInPlace(const std::string& backend) const;
 
   void clearSession(const std::string& id) const;
   void clearSessions() const;
   void clearOldSessions() const;
+  void refreshIndexHashes() const;
+  void sweepResults(const std::map<std::string, std::string>& buildIds) const;
+  bool evictSessions(size_t bytes, const std::string& keep) const;
+  std::string spillSession(const std::string& id, const Requestor& r) const;
+  void restoreSession(const std::shared_ptr<Requestor>& r,
+                      const std::string& id) const;
+  std::shared_ptr<Requestor> getSession(const std::string& id) const;
 
   std::string getSessionId() const;
 
@@ -63,12 +90,19 @@ class Server : public util::http::Handler {
   void drawLine(unsigned char* image, int x0, int y0, int x1, int y1, int w,
                 int h) const;
 
-  size_t _maxMemory;
+  // shared by the geometry caches and all sessions
+  mutable MemoryBudget _memBudget;
 
   std::string _cacheDir;
 
   int _cacheLifetime;
   size_t _autoThreshold;
+  bool _spatialSort;
+  bool _compressLines;
+  int _indexHashTtl;
+
+  // serve the large sections of cache files from a mapping
+  bool _mapCaches;
 
   // Load Status
   mutable size_t _totalSize = 0;
@@ -76,8 +110,23 @@ class Server : public util::http::Handler {
   mutable std::mutex _m;
 
   mutable std::map<std::string, std::shared_ptr<GeomCache>> _caches;
+
+  // backends with a cache rebuild running in the background, and the time
+  // of the last failed rebuild
+  mutable std::set<std::string> _rebuilding;
+  mutable std::map<std::string, std::chrono::steady_clock::time_point>
+      _rebuildFailed;
   mutable std::map<std::string, std::shared_ptr<Requestor>> _rs;
   mutable std::map<std::string, std::string> _queryCache;
+  mutable std::map<std::string, SpilledSession> _spilled;
+
+  // build id of the cache of each backend the results were last swept for
+  mutable std::map<std::string, std::string> _sweptBuildIds;
+
+  // query cache statistics, guarded by _m
+  mutable size_t _queryCacheHits = 0;
+  mutable size_t _queryCacheMisses = 0;
+  mutable size_t _queryCacheUncacheable = 0;
 };
 }  // namespace petrimaps
 